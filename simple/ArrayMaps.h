@@ -0,0 +1,46 @@
+#ifndef SIMPLE_ARRAYMAPS_H_
+#define SIMPLE_ARRAYMAPS_H_
+
+#include "simple.decl.h"
+#include "common.h"
+#include "Reader.h"
+#include "Utility.h"
+#include <algorithm>
+
+extern CProxy_Reader readers;
+
+// TreePieces in key order, in contiguous blocks of PEs. TreePieces outlive
+// decompositions, so blocks are sized by the first TreePiece count and
+// later additions wrap around
+class TreePieceMap : public CBase_TreePieceMap {
+public:
+  TreePieceMap() {}
+
+  static int homeOf(int tp_index) {
+    int n_placed = readers.ckLocalBranch()->n_placed_treepieces;
+    if (n_placed <= 0) return tp_index % CkNumPes();
+    return int((long)tp_index * CkNumPes() / n_placed % CkNumPes());
+  }
+
+  int procNum(int, const CkArrayIndex& idx) {
+    return homeOf(idx.data()[0]);
+  }
+};
+
+// TreeElements with the TreePiece holding the first particle under their
+// key, which is also the TreePiece that creates them
+class TreeElementMap : public CBase_TreeElementMap {
+public:
+  TreeElementMap() {}
+
+  int procNum(int, const CkArrayIndex& idx) {
+    Key key = Key(idx.data()[0]);
+    const std::vector<Key>& tp_starts = readers.ckLocalBranch()->tp_starts;
+    if (!tp_starts.size()) return int(key % Key(CkNumPes()));
+    Key first = Utility::removeLeadingZeros(key);
+    int tp_index = std::upper_bound(tp_starts.begin(), tp_starts.end(), first) - tp_starts.begin() - 1;
+    return TreePieceMap::homeOf(std::max(tp_index, 0));
+  }
+};
+
+#endif // SIMPLE_ARRAYMAPS_H_
@@ -5,12 +5,44 @@
 #include "common.h"
 #include "MultiMsg.h"
 #include "Utility.h"
+#include <algorithm>
+#include <deque>
 #include <map>
+#include <set>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include "templates.h"
 #include "MultiData.h"
+#include "NodeDirectory.h"
+#include "NodeLookup.h"
+#include "Reader.h"
+#include <atomic>
 #include <mutex>
+#include <thread>
+
+extern CProxy_Reader readers;
+extern int cache_budget_mb;
+extern int lookup_entries;
+extern int kept_budget_mb;
+extern int max_particles_per_leaf;
+
+// root of one TreePiece, as gathered by every CacheManager to assemble the
+// top of the tree
+template <typename Data>
+struct TopSummary {
+  Key key;
+  Data data;
+  int n_children; // 0 if the root is a leaf
+  int cm_index;
+
+  void pup(PUP::er& p) {
+    p | key;
+    p | data;
+    p | n_children;
+    p | cm_index;
+  }
+};
 
 template <typename Data>
 class CacheManager : public CBase_CacheManager<Data> {
@@ -18,12 +50,68 @@ public:
   std::mutex local_tps_lock;
   Node<Data>* root;
   std::unordered_map<Key, Node<Data>*> local_tps;
+  std::vector<Node<Data>*> merged_tops; // local nodes above co-located TreePieces
+  std::unordered_map<Key, Data> top_store; // share of the top tree homed here, kept across iterations
+  std::unordered_map<Key, std::set<int>> top_holders; // CacheManagers caching each stored entry
+  std::unordered_map<Key, std::pair<int, CkCallback>> pending_updates; // holders yet to apply a store
+  std::vector<std::pair<Key, Data>> top_pack; // prefetched top nodes, until all homes reply
+  int n_pending_homes = 0;
+  CkCallback prefetch_cb;
+  // the build's reductions to this manager can land after the build is
+  // done, so the prefetch waits for all of them
+  int n_build_inputs = 0;
+  bool prefetch_wanted = false;
+  std::vector<int> occupancy; // prefix summed particle counts at OCCUPANCY_LEVELS
+  std::mutex top_lock;
   std::set<Key> open_list;
   std::vector<std::vector<Node<Data>*>> delete_at_end;
   CProxy_Resumer<Data> resumer;
   Data nodewide_data;
+  NodeDirectory<Data> directory;
+  NodeLookup<Data> lookup; // directory misses, shared by the PEs using this manager
+  int expected_nodes = 0; // directory entries used last iteration
+  // levels shipped below a requested node, by the requested node's depth:
+  // far-field requests near the top and near-field ones deep down adapt
+  // separately
+  int fetch_depths[FETCH_LEVELS];
+  std::atomic<int> n_fetches[FETCH_LEVELS] {}, n_refetches[FETCH_LEVELS] {}; // this iteration
+  // misses collected while TreePieces process their buckets, sent as one
+  // message per destination by flushRequests
+  std::map<int, std::vector<NodeRequest>> pending_nodes; // by owner CacheManager
+  std::map<int, std::vector<NodeRequest>> pending_tp_nodes; // by owner TreePiece
+  std::map<int, std::vector<Key>> pending_tops; // by home CacheManager
+  std::vector<MultiData<Data>> pending_kept; // misses answered from kept
+  std::mutex pending_lock;
+  // remote subtrees received in earlier iterations, by root key, reused
+  // until the version of a TreePiece they were served from changes
+  struct KeptSubtree {
+    int cm_index;
+    int tp_start, tp_end; // serving TreePieces, several under a merged node
+    unsigned long long version;
+    MultiData<Data> data;
+  };
+  std::unordered_map<Key, KeptSubtree> kept;
+  std::vector<unsigned long long> owner_versions; // of every TreePiece's local tree
+  std::atomic<size_t> kept_bytes {0};
+  std::mutex kept_lock;
+  // with a budget, fetched subtrees are evicted oldest first. Walks and
+  // insertions register in n_walkers, and eviction only runs when there
+  // are none, so nothing can hold a pointer into what it frees. Sources
+  // kept for interact() past a walk are held until the iteration ends
+  std::deque<Key> resident; // roots of fetched subtrees, oldest first
+  std::unordered_map<Key, size_t> resident_bytes; // of each resident subtree when it was added
+  std::mutex resident_lock;
+  std::atomic<size_t> cache_bytes {0}; // sum of resident_bytes
+  std::atomic<size_t> replaced_bytes {0}; // placeholders waiting in delete_at_end
+  std::atomic<int> n_walkers {0};
+  std::atomic<bool> evicting {false};
+  std::unordered_set<Key> held; // keys of cached sources in interaction lists
+  std::mutex held_lock;
+  std::unordered_set<Key> evicted; // this iteration
+  std::atomic<int> n_evictions {0}, n_evicted_refetches {0};
 
   CacheManager() { // : root(nullptr), curr_waiting (std::map<Key, std::vector<int> >()) {}
+    std::fill(fetch_depths, fetch_depths + FETCH_LEVELS, DEFAULT_FETCH_DEPTH);
     initialize();
   }
   void initialize() {
@@ -31,36 +119,116 @@ public:
     node->type = Node<Data>::Boundary;
     root = node;
     delete_at_end.resize(CkNodeSize(0));
+    directory.reset(expected_nodes);
+    if (!lookup.capacity()) lookup.resize(lookup_entries > 0 ? lookup_entries : LOOKUP_ENTRIES_PER_PE * (this->isNodeGroup() ? CkNodeSize(0) : 1),
+        this->isNodeGroup() ? CkMyNodeSize() : 1);
+    directory.insert(root->key, root);
   }
 
   ~CacheManager() {
     destroy(false);
   }
+  static int numManagers() {
+#if GROUPCACHE
+    return CkNumPes();
+#else
+    return CkNumNodes();
+#endif
+  }
+  static int homeOf(Key key) {
+#if GROUPCACHE
+    return int(key % Key(CkNumPes()));
+#else
+    return int(key % Key(CkNumNodes()));
+#endif
+  }
   void prepPrefetch(Node<Data>*);
-  template <typename Visitor>
-  void startPrefetch(DPHolder<Data>, TEHolder<Data>, CkCallback);
-  void startParentPrefetch(DPHolder<Data>, TEHolder<Data>, CkCallback);
+  void storeTop(std::pair<Key, Data>, const CkCallback&);
+  void requestTop(Key*, int, int);
+  void startParentPrefetch(const CkCallback&);
+  void buildInputDone();
+  void prefetchTop();
+  void reset(bool, const CkCallback&);
+  void sizeDirectory(int, const CkCallback&);
   void connect(Node<Data>*, bool);
-  void requestNodes(std::pair<Key, int>);
-  void serviceRequest(Node<Data>*, int);
-  void recvStarterPack(std::pair<Key, Data>* pack, int n, CkCallback);
+  int fetchDepth(Node<Data>*);
+  void adaptFetchDepth();
+  void queueRequest(Node<Data>*);
+  void flushRequests();
+  void requestNodes(NodeRequest*, int);
+  void requestTops(Key*, int, int);
+  void serviceRequests(std::vector<std::pair<Node<Data>*, int>>&, int);
+  MultiData<Data> packSubtree(Node<Data>*, int);
+  void recvStarterPack(std::pair<Key, Data>* pack, int n);
+  void recvTopSummaries(CkReductionMsg*);
+  void recvOccupancy(CkReductionMsg*);
+  void recvVersions(CkReductionMsg*);
+  bool findKept(Node<Data>*, MultiData<Data>&);
+  // combined version of a range of TreePieces, 0 if any is unknown
+  unsigned long long versionOf(int tp_start, int tp_end) const {
+    if (tp_start < 0 || tp_end >= (int)owner_versions.size()) return 0;
+    unsigned long long version = 14695981039346656037ULL;
+    for (int tp = tp_start; tp <= tp_end; tp++) version = (version ^ owner_versions[tp]) * 1099511628211ULL;
+    return version;
+  }
+  static size_t bytesOf(const MultiData<Data>& multidata) {
+    return multidata.nodes.size() * sizeof(Node<Data>) + multidata.particles.size() * sizeof(Particle);
+  }
+  void beginWalk();
+  void endWalk();
+  void hold(Node<Data>*);
+  void evict();
+  int countUnder(Key);
   void addCache(MultiMsg<Data>*);
-  void addCache(MultiData<Data>);
+  void addCache(std::vector<MultiData<Data>>);
   Node<Data>* addCacheHelper(Particle*, int, Node<Data>*, int);
-  void restoreData(std::pair<Key, Data>);
+  void restoreData(std::pair<Key, Data>*, int);
   void restoreDataHelper(std::pair<Key, Data>&, bool);
   void insertNode(Node<Data>*, bool, bool);
+  Node<Data>* makeChild(Node<Data>*, int, bool);
+  void updateTop(std::pair<Key, Data>, int);
+  void updateDone(Key);
+  void pruneTop();
+  void refreshTop();
   void swapIn(Node<Data>*);
   void process(Key);
-  void destroy(bool restore) {
+  void mergeLocalTrees();
+  Node<Data>* findNode(Key);
+  void destroy(bool restore, bool keep_top = false) {
+    // local TreePiece subtrees belong to their TreePieces, so unhook them
+    // before freeing the cached tree
+    if (root != nullptr) {
+      for (auto& local_tp : local_tps) {
+        Key key = local_tp.first;
+        if (key <= 1) continue;
+        Node<Data>* parent = findNode(key >> LOG_BRANCH_FACTOR);
+        if (parent && parent->children[key % BRANCH_FACTOR].load() == local_tp.second) {
+          parent->children[key % BRANCH_FACTOR].store(nullptr);
+        }
+      }
+    }
+    for (auto merged : merged_tops) {
+      for (int i = 0; i < BRANCH_FACTOR; i++) merged->children[i].store(nullptr);
+      delete merged;
+    }
+    merged_tops.resize(0);
     local_tps.clear();
     open_list.clear();
+    lookup.clear();
+    expected_nodes = directory.size();
     for (auto& dae : delete_at_end) {
         for (auto to_delete : dae) {
           delete to_delete;
         }
         dae.resize(0);
     }
+    if (root != nullptr && keep_top && root->type == Node<Data>::CachedBoundary) {
+      // only the CachedBoundary nodes stay, indexed in a fresh directory
+      pruneTop();
+      directory.reset(expected_nodes);
+      directory.insertSubtree(root);
+      return;
+    }
     if (root != nullptr) {
       root->triggerFree();
       delete root;
@@ -71,53 +239,430 @@ public:
 };
 
 template <typename Data>
-template <typename Visitor>
-void CacheManager<Data>::startPrefetch(DPHolder<Data> dp_holder, TEHolder<Data> global_data, CkCallback cb) {
-  dp_holder.d_proxy.template prefetch<Visitor>(nodewide_data, this->thisIndex, global_data.te_proxy, cb);
+void CacheManager<Data>::storeTop(std::pair<Key, Data> param, const CkCallback& cb) {
+  // TreeElements only store changed values, which go on to the caches
+  // still holding the old ones; the store is done once they all have it
+  std::set<int> holders;
+  if (this->isNodeGroup()) top_lock.lock();
+  top_store[param.first] = param.second;
+  auto it = top_holders.find(param.first);
+  if (it != top_holders.end()) holders = it->second;
+  if (holders.size()) pending_updates[param.first] = std::make_pair(int(holders.size()), cb);
+  if (this->isNodeGroup()) top_lock.unlock();
+  if (holders.empty()) cb.send();
+  for (int cm_index : holders) this->thisProxy[cm_index].updateTop(param, this->thisIndex);
 }
 
 template <typename Data>
-void CacheManager<Data>::startParentPrefetch(DPHolder<Data> dp_holder, TEHolder<Data> global_data, CkCallback cb) {
+void CacheManager<Data>::updateTop(std::pair<Key, Data> param, int home) {
+  Node<Data>* node = findNode(param.first);
+  if (node && node->key == param.first && node->type == Node<Data>::CachedBoundary) node->data = param.second;
+  this->thisProxy[home].updateDone(param.first);
+}
+
+template <typename Data>
+void CacheManager<Data>::updateDone(Key key) {
+  CkCallback cb;
+  bool complete = false;
+  if (this->isNodeGroup()) top_lock.lock();
+  auto it = pending_updates.find(key);
+  if (--it->second.first == 0) {
+    cb = it->second.second;
+    pending_updates.erase(it);
+    complete = true;
+  }
+  if (this->isNodeGroup()) top_lock.unlock();
+  if (complete) cb.send();
+}
+
+template <typename Data>
+void CacheManager<Data>::requestTop(Key* keys, int n, int cm_index) {
+  std::vector<std::pair<Key, Data>> to_send;
+  if (this->isNodeGroup()) top_lock.lock();
+  for (int i = 0; i < n; i++) {
+    auto it = top_store.find(keys[i]);
+    if (it != top_store.end()) {
+      to_send.push_back(*it);
+      top_holders[keys[i]].insert(cm_index);
+    }
+  }
+  if (this->isNodeGroup()) top_lock.unlock();
+  this->thisProxy[cm_index].recvStarterPack(to_send.data(), to_send.size());
+}
+
+template <typename Data>
+void CacheManager<Data>::startParentPrefetch(const CkCallback& cb) {
+  prefetch_cb = cb;
+  if (this->isNodeGroup()) top_lock.lock();
+  prefetch_wanted = true;
+  bool ready = (n_build_inputs == BUILD_INPUTS);
+  if (this->isNodeGroup()) top_lock.unlock();
+  if (ready) prefetchTop();
+}
+
+template <typename Data>
+void CacheManager<Data>::buildInputDone() {
+  if (this->isNodeGroup()) top_lock.lock();
+  bool ready = (++n_build_inputs == BUILD_INPUTS && prefetch_wanted);
+  if (this->isNodeGroup()) top_lock.unlock();
+  if (ready) prefetchTop();
+}
+
+template <typename Data>
+void CacheManager<Data>::prefetchTop() {
+#if COLLECTIVE_TOP
+  // the top tree was already assembled from the summaries
+  this->contribute(prefetch_cb);
+#else
+#if MERGELOCAL
+  mergeLocalTrees();
+#endif
   std::set<Key> request_list;
   for (Key k : open_list) {
+    if (local_tps.count(k)) continue;
     for (int i = 0; i < BRANCH_FACTOR; i++) {
       request_list.insert(k * BRANCH_FACTOR + i);
     }
   }
   request_list.insert(1);
-  std::vector<Key> flat_rl (request_list.size());
-  std::copy(request_list.begin(), request_list.end(), flat_rl.begin());
-  dp_holder.d_proxy.request(flat_rl.data(), flat_rl.size(), this->thisIndex, global_data.te_proxy, cb);
+  // top nodes kept from the last iteration are updated by their homes,
+  // only the rest is asked for
+  refreshTop();
+  // the top tree is spread over all CacheManagers by key, so ask each home
+  // for its share of the list
+  std::map<int, std::vector<Key>> by_home;
+  for (Key k : request_list) {
+    Node<Data>* kept_top = findNode(k);
+    if (kept_top && kept_top->key == k && kept_top->type == Node<Data>::CachedBoundary) continue;
+    by_home[homeOf(k)].push_back(k);
+  }
+  top_pack.resize(0);
+  n_pending_homes = by_home.size();
+  if (by_home.empty()) this->contribute(prefetch_cb);
+  for (auto& home : by_home) {
+    this->thisProxy[home.first].requestTop(home.second.data(), home.second.size(), this->thisIndex);
+  }
+#endif
 }
 
 template <typename Data>
-void CacheManager<Data>::recvStarterPack(std::pair<Key, Data>* pack, int n, CkCallback cb) {
-  CkPrintf("[CacheManager %d] receiving starter pack, size = %d\n", this->thisIndex, n);
-  for (int i = 0; i < n; i++) {
+void CacheManager<Data>::recvStarterPack(std::pair<Key, Data>* pack, int n) {
+  // homes reply in any order, but parents have to be restored before
+  // their children, so wait for every reply and restore them sorted
+  if (this->isNodeGroup()) top_lock.lock();
+  top_pack.insert(top_pack.end(), pack, pack + n);
+  bool complete = (--n_pending_homes == 0);
+  if (this->isNodeGroup()) top_lock.unlock();
+  if (!complete) return;
+  std::sort(top_pack.begin(), top_pack.end(),
+      [](const std::pair<Key, Data>& a, const std::pair<Key, Data>& b) { return a.first < b.first; });
+  CkPrintf("[CacheManager %d] receiving starter pack, size = %d\n", this->thisIndex, (int)top_pack.size());
+  for (auto& top : top_pack) {
 #if DEBUG
-    CkPrintf("[CM %d] receiving node %d in starter pack\n", this->thisIndex, pack[i].first);
+    CkPrintf("[CM %d] receiving node %d in starter pack\n", this->thisIndex, top.first);
 #endif
-    if (!local_tps.count(pack[i].first)) {
-      restoreDataHelper(pack[i], false);
+    if (!local_tps.count(top.first)) {
+      restoreDataHelper(top, false);
     }
   }
+  top_pack.resize(0);
+  this->contribute(prefetch_cb);
+}
+
+template <typename Data>
+void CacheManager<Data>::reset(bool clear_top, const CkCallback& cb) {
+  adaptFetchDepth();
+#if COLLECTIVE_TOP
+  destroy(true); // the top tree is rebuilt by every build
+#else
+  destroy(true, !clear_top);
+#endif
+  // top tree entries and kept subtrees of an old decomposition would be stale
+  if (clear_top) {
+    top_store.clear();
+    top_holders.clear();
+    kept.clear();
+    kept_bytes = 0;
+  }
+  n_build_inputs = 0;
+  prefetch_wanted = false;
+  resident.clear();
+  resident_bytes.clear();
+  cache_bytes = 0;
+  replaced_bytes = 0;
+  held.clear();
+  evicted.clear();
+  long long counts[4] = {n_evictions.exchange(0), n_evicted_refetches.exchange(0), 0, 0};
+  lookup.takeCounts(counts[2], counts[3]);
+  this->contribute(4 * sizeof(long long), counts, CkReduction::sum_long_long, cb);
+}
+
+template <typename Data>
+void CacheManager<Data>::sizeDirectory(int n_particles, const CkCallback& cb) {
+  // estimate local nodes from half-full leaves, and as many again for
+  // remote ones, rather than learning the size over a whole iteration
+  int n_local = n_particles / numManagers() + 1;
+  int n_leaves = n_local / std::max(1, max_particles_per_leaf / 2) + 1;
+  int estimate = 2 * (n_leaves + n_leaves / (BRANCH_FACTOR - 1) + 1);
+  expected_nodes = std::max(expected_nodes, estimate);
+  // nothing but the root is indexed before the first build
+  if (directory.size() <= 1) {
+    directory.reset(expected_nodes);
+    directory.insert(root->key, root);
+  }
   this->contribute(cb);
 }
 
+template <typename Data>
+void CacheManager<Data>::beginWalk() {
+  if (cache_budget_mb <= 0) return;
+  while (true) {
+    n_walkers++;
+    if (!evicting.load()) return;
+    n_walkers--;
+    // an eviction is short; let the other threads of this process run
+    // rather than spin against the evicting PE
+    while (evicting.load()) std::this_thread::yield();
+  }
+}
+
+template <typename Data>
+void CacheManager<Data>::endWalk() {
+  if (cache_budget_mb <= 0) return;
+  n_walkers--;
+  evict();
+}
+
+template <typename Data>
+void CacheManager<Data>::hold(Node<Data>* node) {
+  // called inside a walk, so eviction cannot be running
+  if (cache_budget_mb <= 0 || node->type != Node<Data>::CachedRemoteLeaf) return;
+  if (this->isNodeGroup()) held_lock.lock();
+  held.insert(node->key);
+  if (this->isNodeGroup()) held_lock.unlock();
+}
+
+template <typename Data>
+void CacheManager<Data>::evict() {
+  size_t budget = size_t(cache_budget_mb) << 20;
+  if (cache_bytes + replaced_bytes + kept_bytes <= budget) return;
+  bool expected = false;
+  if (!evicting.compare_exchange_strong(expected, true)) return;
+  if (n_walkers > 0) {
+    evicting = false;
+    return;
+  }
+  // with no walkers nothing points at a replaced placeholder any more
+  for (auto& dae : delete_at_end) {
+    for (auto to_delete : dae) delete to_delete;
+    dae.resize(0);
+  }
+  replaced_bytes = 0;
+  // then copies kept from earlier iterations
+  if (this->isNodeGroup()) kept_lock.lock();
+  while (cache_bytes + kept_bytes > budget && kept.size()) {
+    kept_bytes -= bytesOf(kept.begin()->second.data);
+    kept.erase(kept.begin());
+  }
+  if (this->isNodeGroup()) kept_lock.unlock();
+  int n_resident = resident.size();
+  for (int i = 0; i < n_resident && cache_bytes + kept_bytes > budget; i++) {
+    Key key = resident.front();
+    resident.pop_front();
+    Node<Data>* node = findNode(key);
+    // gone already if an ancestor was evicted
+    if (node == nullptr || (node->type != Node<Data>::CachedRemote && node->type != Node<Data>::CachedRemoteLeaf)
+        || !resident_bytes.count(key)) continue;
+    // an outstanding request below needs its placeholder for the reply,
+    // and a held source has to outlive the walk that found it. Subtrees
+    // fetched later below this one go with it, so their bytes do too
+    bool pinned = false;
+    std::vector<Key> keys, resident_keys;
+    std::vector<Node<Data>*> stack (1, node);
+    while (stack.size()) {
+      Node<Data>* curr = stack.back();
+      stack.pop_back();
+      keys.push_back(curr->key);
+      if (resident_bytes.count(curr->key)) resident_keys.push_back(curr->key);
+      if ((curr->type == Node<Data>::Remote || curr->type == Node<Data>::RemoteLeaf) && curr->requested) pinned = true;
+      // held is only added to inside walks, and there are none now
+      if (held.size() && held.count(curr->key)) pinned = true;
+      if (curr->type == Node<Data>::CachedRemote) {
+        for (int j = 0; j < curr->n_children; j++) {
+          Node<Data>* child = curr->children[j].load();
+          if (child) stack.push_back(child);
+        }
+      }
+    }
+    if (pinned) {
+      resident.push_back(key);
+      continue;
+    }
+    // a fresh placeholder, like the ones left below a reply, so it can be
+    // requested again
+    Node<Data>* placeholder = new Node<Data>(key, node->depth, node->n_particles, nullptr, node->owner_tp_start, node->owner_tp_end, node->parent, node->tp_index);
+    placeholder->type = (node->type == Node<Data>::CachedRemoteLeaf) ? Node<Data>::RemoteLeaf : Node<Data>::Remote;
+    placeholder->data = node->data;
+    placeholder->cm_index = node->cm_index;
+    node->parent->children[key % BRANCH_FACTOR].store(placeholder);
+    for (Key k : keys) directory.remove(k);
+    directory.insert(key, placeholder);
+    node->triggerFree();
+    delete node;
+    for (Key k : resident_keys) {
+      cache_bytes -= resident_bytes[k];
+      resident_bytes.erase(k);
+    }
+    evicted.insert(key);
+    n_evictions++;
+  }
+  lookup.clear();
+  evicting = false;
+}
+
+template <typename Data>
+void CacheManager<Data>::recvOccupancy(CkReductionMsg* msg) {
+  int* counts = (int*)msg->getData();
+  int n_bins = msg->getSize() / sizeof(int);
+  occupancy.resize(n_bins + 1);
+  occupancy[0] = 0;
+  for (int i = 0; i < n_bins; i++) occupancy[i + 1] = occupancy[i] + counts[i];
+  delete msg;
+  buildInputDone();
+}
+
+template <typename Data>
+void CacheManager<Data>::recvVersions(CkReductionMsg* msg) {
+  // one (TreePiece, version) pair from each TreePiece, in any order
+  std::pair<int, unsigned long long>* versions = (std::pair<int, unsigned long long>*)msg->getData();
+  int n = msg->getSize() / sizeof(std::pair<int, unsigned long long>);
+  owner_versions.assign(n, 0);
+  for (int i = 0; i < n; i++) {
+    if (versions[i].first >= (int)owner_versions.size()) owner_versions.resize(versions[i].first + 1, 0);
+    owner_versions[versions[i].first] = versions[i].second;
+  }
+  delete msg;
+  buildInputDone();
+}
+
+template <typename Data>
+bool CacheManager<Data>::findKept(Node<Data>* node, MultiData<Data>& multidata) {
+  // stale entries are only dropped when they are next asked for
+  if (kept_budget_mb <= 0) return false;
+  bool found = false;
+  if (this->isNodeGroup()) kept_lock.lock();
+  auto it = kept.find(node->key);
+  if (it != kept.end()) {
+    KeptSubtree& entry = it->second;
+    if ((node->cm_index < 0 || node->cm_index == entry.cm_index) && entry.version == versionOf(entry.tp_start, entry.tp_end)) {
+      multidata = entry.data;
+      found = true;
+    }
+    else {
+      kept_bytes -= bytesOf(entry.data);
+      kept.erase(it);
+    }
+  }
+  if (this->isNodeGroup()) kept_lock.unlock();
+  return found;
+}
+
+template <typename Data>
+int CacheManager<Data>::countUnder(Key key) {
+  // -1 if the key is below the levels counted
+  if (!occupancy.size()) return -1;
+  int depth = Utility::getDepthFromKey(key);
+  if (depth > OCCUPANCY_LEVELS) return -1;
+  int shift = LOG_BRANCH_FACTOR * (OCCUPANCY_LEVELS - depth);
+  int first = int(key - (Key(1) << (LOG_BRANCH_FACTOR * depth))) << shift;
+  return occupancy[first + (1 << shift)] - occupancy[first];
+}
+
+template <typename Data>
+void CacheManager<Data>::recvTopSummaries(CkReductionMsg* msg) {
+#if MERGELOCAL
+  mergeLocalTrees();
+#endif
+  // sum every ancestor of the TreePiece roots; keys sort parents first
+  std::map<Key, Data> tops;
+  std::vector<TopSummary<Data>> remote_roots;
+  PUP::fromMem unpacker (msg->getData());
+  while (unpacker.size() < msg->getSize()) {
+    TopSummary<Data> summary;
+    unpacker | summary;
+    for (Key key = summary.key >> LOG_BRANCH_FACTOR; key >= 1; key >>= LOG_BRANCH_FACTOR) {
+      tops[key] += summary.data;
+    }
+    if (!local_tps.count(summary.key)) remote_roots.push_back(summary);
+  }
+  delete msg;
+  for (auto& top : tops) {
+    if (local_tps.count(top.first)) continue;
+    std::pair<Key, Data> param (top.first, top.second);
+    restoreDataHelper(param, false);
+  }
+  // remote TreePiece roots replace the placeholders left below the top;
+  // their subtrees are then fetched from the owning CacheManager
+  for (auto& summary : remote_roots) {
+    Node<Data>* parent = (summary.key > 1) ? findNode(summary.key >> LOG_BRANCH_FACTOR) : nullptr;
+    if (summary.key > 1 && parent == nullptr) continue;
+    Node<Data>* node = new Node<Data>(summary.key, Node<Data>::Remote, summary.data, summary.n_children, parent);
+    node->cm_index = summary.cm_index;
+    if (summary.n_children) {
+      node->type = Node<Data>::CachedRemote;
+      insertNode(node, false, true);
+    }
+    else swapIn(node);
+  }
+  buildInputDone();
+}
+
 template <typename Data>
 void CacheManager<Data>::addCache(MultiMsg<Data>* multimsg) {
+  beginWalk();
   Node<Data>* top_node = addCacheHelper(multimsg->particles, multimsg->n_particles, multimsg->nodes, multimsg->n_nodes);
   delete multimsg;
-  process(top_node->key);
+  // endWalk may evict what was just added
+  Key key = top_node->key;
+  endWalk();
+  process(key);
 }
 
 template <typename Data>
-void CacheManager<Data>::addCache(MultiData<Data> multidata) {
+void CacheManager<Data>::addCache(std::vector<MultiData<Data>> replies) {
+  beginWalk();
+  for (auto& multidata : replies) {
 #if DEBUG
-  CkPrintf("adding cache for node %d\n", multidata.nodes[0].key);
+    CkPrintf("adding cache for node %d\n", multidata.nodes[0].key);
 #endif
-  Node<Data>* top_node = addCacheHelper(multidata.particles, multidata.n_particles, multidata.nodes, multidata.n_nodes);
-  process(top_node->key);
+    Node<Data>* top_node = addCacheHelper(multidata.particles.data(), multidata.particles.size(), multidata.nodes.data(), multidata.nodes.size());
+    process(top_node->key);
+    const Node<Data>& served = multidata.nodes[0];
+    int owner = served.cm_index;
+    int tp_start = (served.tp_index >= 0) ? served.tp_index : served.owner_tp_start;
+    int tp_end = (served.tp_index >= 0) ? served.tp_index : served.owner_tp_end;
+    unsigned long long version = versionOf(tp_start, tp_end);
+    if (kept_budget_mb > 0 && owner >= 0 && version) {
+      // the copies have their own budget, whether or not the cache has one
+      size_t kept_budget = size_t(kept_budget_mb) << 20;
+      if (this->isNodeGroup()) kept_lock.lock();
+      auto it = kept.find(top_node->key);
+      if (it != kept.end()) {
+        kept_bytes -= bytesOf(it->second.data);
+        kept.erase(it);
+      }
+      while (kept.size() && kept_bytes + bytesOf(multidata) > kept_budget) {
+        kept_bytes -= bytesOf(kept.begin()->second.data);
+        kept.erase(kept.begin());
+      }
+      if (bytesOf(multidata) <= kept_budget) {
+        kept_bytes += bytesOf(multidata);
+        kept[top_node->key] = KeptSubtree {owner, tp_start, tp_end, version, std::move(multidata)};
+      }
+      if (this->isNodeGroup()) kept_lock.unlock();
+    }
+  }
+  endWalk();
 }
 
 template <typename Data>
@@ -127,6 +672,7 @@ Node<Data>* CacheManager<Data>::addCacheHelper(Particle* particles, int n_partic
   CkPrintf("adding cache for node %d on cm %d\n", nodes[0].key, this->thisIndex);
 #endif
   Node<Data>* first_node;
+  int n_slots = 1; // the subtree's root and every child slot below it
   if (first_node_placeholder->type != Node<Data>::CachedRemote && first_node_placeholder->type != Node<Data>::CachedRemoteLeaf) {
     int p_index = 0;
     for (int j = 0; j < n_nodes; j++) {
@@ -136,8 +682,8 @@ Node<Data>* CacheManager<Data>::addCacheHelper(Particle* particles, int n_partic
         first_node = node;
       }
       else {
-        if (first_node->key == (node->key >> LOG_BRANCH_FACTOR)) node->parent = first_node;
-        else node->parent = first_node->children[(node->key >> LOG_BRANCH_FACTOR) % BRANCH_FACTOR].load();
+        // replies arrive breadth first, so the parent is already in place
+        node->parent = first_node->findNode(node->key >> LOG_BRANCH_FACTOR);
       }
       if (node->type == Node<Data>::Leaf || node->type == Node<Data>::EmptyLeaf) {
         node->type = Node<Data>::CachedRemoteLeaf;
@@ -151,36 +697,168 @@ Node<Data>* CacheManager<Data>::addCacheHelper(Particle* particles, int n_partic
         node->type = Node<Data>::CachedRemote;
       }
       insertNode(node, false, j > 0);
+      n_slots += node->n_children;
     }
   } else CkAbort("Invalid node placeholder type in CacheManager::addCacheHelper");
   swapIn(first_node);
+  if (cache_budget_mb > 0) {
+    // the reply's nodes and the placeholders left below them, which are
+    // exactly what evict frees with the subtree
+    size_t bytes = n_slots * sizeof(Node<Data>) + n_particles * sizeof(Particle);
+    cache_bytes += bytes;
+    if (this->isNodeGroup()) resident_lock.lock();
+    resident.push_back(first_node->key);
+    resident_bytes[first_node->key] = bytes;
+    if (this->isNodeGroup()) resident_lock.unlock();
+  }
   return first_node;
 }
 
 template <typename Data>
-void CacheManager<Data>::requestNodes(std::pair<Key, int> param) {
-  Key key = param.first;
-  Key temp = key;
-  while (!local_tps.count(temp)) temp /= BRANCH_FACTOR;
-  Node<Data>* node = local_tps[temp]->findNode(key);
-  if (!node) {
-    CkPrintf("CacheManager::requestNodes: node not found for key %d on cm %d\n", param.first, this->thisIndex);
-    CkAbort("CacheManager::requestNodes: node not found");
+int CacheManager<Data>::fetchDepth(Node<Data>* node) {
+  // a placeholder under a fetched node is the bottom of an earlier reply,
+  // and the walk that got there is likely to keep going, so it gets one
+  // more level than a fresh request at the same depth
+  int level = std::min(node->depth, FETCH_LEVELS - 1);
+  bool continued = node->parent && node->parent->type == Node<Data>::CachedRemote;
+  n_fetches[level]++;
+  if (continued) n_refetches[level]++;
+  return std::min(fetch_depths[level] + (continued ? 1 : 0), MAX_FETCH_DEPTH);
+}
+
+template <typename Data>
+void CacheManager<Data>::adaptFetchDepth() {
+  // per level, go deeper when most fetches continue an earlier one (near
+  // field), and shallower when few do (far field)
+  for (int level = 0; level < FETCH_LEVELS; level++) {
+    int fetches = n_fetches[level].exchange(0), refetches = n_refetches[level].exchange(0);
+    if (fetches < 16) continue;
+    int& fetch_depth = fetch_depths[level];
+    if (2 * refetches > fetches && fetch_depth < MAX_FETCH_DEPTH) fetch_depth++;
+    else if (10 * refetches < fetches && fetch_depth > 1) fetch_depth--;
+#if DEBUG
+    CkPrintf("[CM %d] %d of %d fetches at depth %d continued earlier ones, fetch depth now %d\n", this->thisIndex, refetches, fetches, level, fetch_depth);
+#endif
   }
-  serviceRequest(node, param.second);
 }
 
 template <typename Data>
-void CacheManager<Data>::serviceRequest(Node<Data>* node, int cm_index) {
+void CacheManager<Data>::queueRequest(Node<Data>* node) {
+  if (evicted.count(node->key)) n_evicted_refetches++;
+  MultiData<Data> multidata;
+  if (findKept(node, multidata)) {
+    if (this->isNodeGroup()) pending_lock.lock();
+    pending_kept.push_back(std::move(multidata));
+    if (this->isNodeGroup()) pending_lock.unlock();
+    return;
+  }
+  NodeRequest request = {node->key, this->thisIndex, fetchDepth(node)};
+  if (this->isNodeGroup()) pending_lock.lock();
+  if (node->type == Node<Data>::Boundary || node->type == Node<Data>::RemoteAboveTPKey) {
+    // a top node inside a single TreePiece goes straight to it, nodes
+    // spanning several TreePieces are answered from the top tree store
+    int owner = readers.ckLocalBranch()->ownerOf(node->key);
+    if (owner >= 0) pending_tp_nodes[owner].push_back(request);
+    else pending_tops[homeOf(node->key)].push_back(node->key);
+  }
+  else pending_nodes[node->cm_index].push_back(request);
+  if (this->isNodeGroup()) pending_lock.unlock();
+}
+
+template <typename Data>
+void CacheManager<Data>::flushRequests() {
+  std::map<int, std::vector<NodeRequest>> nodes, tp_nodes;
+  std::map<int, std::vector<Key>> tops;
+  std::vector<MultiData<Data>> from_kept;
+  if (this->isNodeGroup()) pending_lock.lock();
+  std::swap(nodes, pending_nodes);
+  std::swap(tp_nodes, pending_tp_nodes);
+  std::swap(tops, pending_tops);
+  std::swap(from_kept, pending_kept);
+  if (this->isNodeGroup()) pending_lock.unlock();
+  for (auto& multidata : from_kept) {
+    Node<Data>* top_node = addCacheHelper(multidata.particles.data(), multidata.particles.size(), multidata.nodes.data(), multidata.nodes.size());
+    process(top_node->key);
+  }
+  for (auto& dest : nodes) {
+    this->thisProxy[dest.first].requestNodes(dest.second.data(), dest.second.size());
+  }
+  CProxy_TreePiece<Data> tp_proxy = resumer.ckLocalBranch()->tp_proxy;
+  for (auto& dest : tp_nodes) {
+    tp_proxy[dest.first].requestNodes(dest.second.data(), dest.second.size());
+  }
+  for (auto& dest : tops) {
+    this->thisProxy[dest.first].requestTops(dest.second.data(), dest.second.size(), this->thisIndex);
+  }
+}
+
+template <typename Data>
+void CacheManager<Data>::requestNodes(NodeRequest* requests, int n) {
+  // a batch always comes from a single CacheManager
+  std::vector<std::pair<Node<Data>*, int>> to_send;
+  for (int i = 0; i < n; i++) {
+    Key key = requests[i].key;
+    Node<Data>* node = directory.find(key);
+    if (!node) {
+      Key temp = key;
+      while (!local_tps.count(temp)) temp /= BRANCH_FACTOR;
+      node = local_tps[temp]->findNode(key);
+    }
+    if (!node) {
+      CkPrintf("CacheManager::requestNodes: node not found for key %d on cm %d\n", key, this->thisIndex);
+      CkAbort("CacheManager::requestNodes: node not found");
+    }
+    to_send.push_back(std::make_pair(node, requests[i].depth));
+  }
+  if (n) serviceRequests(to_send, requests[0].cm_index);
+}
+
+template <typename Data>
+void CacheManager<Data>::requestTops(Key* keys, int n, int cm_index) {
+  // TreeElements publish every top node spanning several TreePieces here
+  std::vector<std::pair<Key, Data>> to_send;
+  if (this->isNodeGroup()) top_lock.lock();
+  for (int i = 0; i < n; i++) {
+    auto it = top_store.find(keys[i]);
+    if (it == top_store.end()) {
+      CkPrintf("CacheManager::requestTops: top node %d not stored on cm %d\n", keys[i], this->thisIndex);
+      CkAbort("CacheManager::requestTops: top node not found");
+    }
+    to_send.push_back(*it);
+    top_holders[keys[i]].insert(cm_index);
+  }
+  if (this->isNodeGroup()) top_lock.unlock();
+  this->thisProxy[cm_index].restoreData(to_send.data(), to_send.size());
+}
+
+template <typename Data>
+void CacheManager<Data>::serviceRequests(std::vector<std::pair<Node<Data>*, int>>& to_send, int cm_index) {
   if (cm_index == this->thisIndex) return; // you'll get it later!
+  std::vector<MultiData<Data>> replies;
+  for (auto& request : to_send) replies.push_back(packSubtree(request.first, request.second));
+  this->thisProxy[cm_index].addCache(replies);
+}
+
+template <typename Data>
+MultiData<Data> CacheManager<Data>::packSubtree(Node<Data>* node, int depth) {
+  // breadth first, so parents always precede their children; nodes left
+  // out past the depth or the budget stay placeholders at the requester
   std::vector<Node<Data>> sending_nodes;
   std::vector<Particle> sending_particles;
-  sending_nodes.push_back(*node);
-  for (int i = 0; i < node->n_children; i++) {
-    Node<Data>* child = node->children[i].load();
-    sending_nodes.push_back(*child);
-    for (int j = 0; j < child->n_children; j++)
-      sending_nodes.push_back(*(child->children[j].load()));
+  std::vector<Node<Data>*> frontier (1, node);
+  size_t bytes = sizeof(Node<Data>);
+  for (int next = 0; next < frontier.size(); next++) {
+    Node<Data>* curr = frontier[next];
+    sending_nodes.push_back(*curr);
+    if (curr->depth - node->depth >= depth) continue;
+    for (int i = 0; i < curr->n_children; i++) {
+      Node<Data>* child = curr->children[i].load();
+      size_t child_bytes = sizeof(Node<Data>);
+      if (child->type == Node<Data>::Leaf) child_bytes += child->n_particles * sizeof(Particle);
+      if (bytes + child_bytes > FETCH_BUDGET_BYTES) continue;
+      bytes += child_bytes;
+      frontier.push_back(child);
+    }
   }
   for (auto& to_send : sending_nodes) {
     to_send.cm_index = this->thisIndex;
@@ -188,13 +866,14 @@ void CacheManager<Data>::serviceRequest(Node<Data>* node, int cm_index) {
       sending_particles.insert(sending_particles.end(), to_send.particles, to_send.particles + to_send.n_particles);
     }
   }
-  MultiData<Data> multidata (sending_particles.data(), sending_particles.size(), sending_nodes.data(), sending_nodes.size());
-  this->thisProxy[cm_index].addCache(multidata);
+  return MultiData<Data>(sending_particles.data(), sending_particles.size(), sending_nodes.data(), sending_nodes.size());
 }
 
 template <typename Data>
-void CacheManager<Data>::restoreData(std::pair<Key, Data> param) {
-  restoreDataHelper(param, true);
+void CacheManager<Data>::restoreData(std::pair<Key, Data>* tops, int n) {
+  beginWalk();
+  for (int i = 0; i < n; i++) restoreDataHelper(tops[i], true);
+  endWalk();
 }
 
 template <typename Data>
@@ -203,13 +882,15 @@ void CacheManager<Data>::restoreDataHelper(std::pair<Key, Data>& param, bool sho
   if (!should_process) CkPrintf("restoring data for node %d\n", param.first);
 #endif
   Key key = param.first;
-  Node<Data>* node = new Node<Data>(key, Node<Data>::CachedBoundary, param.second, BRANCH_FACTOR, (key > 1) ? root->findNode(key >> LOG_BRANCH_FACTOR) : nullptr);
+  Node<Data>* node = new Node<Data>(key, Node<Data>::CachedBoundary, param.second, BRANCH_FACTOR, (key > 1) ? findNode(key >> LOG_BRANCH_FACTOR) : nullptr);
   insertNode(node, true, false);
   connect(node, should_process);
 }
 
 template <typename Data>
 void CacheManager<Data>::swapIn(Node<Data>* to_swap) {
+  directory.insert(to_swap->key, to_swap);
+  lookup.replace(to_swap);
   if (to_swap->key > 1) {
     to_swap = to_swap->parent->children[to_swap->key % BRANCH_FACTOR].exchange(to_swap);
   }
@@ -217,6 +898,7 @@ void CacheManager<Data>::swapIn(Node<Data>* to_swap) {
     std::swap(root, to_swap);
   }
   delete_at_end[CkMyRank()].push_back(to_swap);
+  replaced_bytes += sizeof(Node<Data>);
 }
 
 template <typename Data>
@@ -245,6 +927,7 @@ void CacheManager<Data>::connect(Node<Data>* node, bool should_process) {
     local_tps.insert(std::make_pair(node->key, node));
     prepPrefetch(node);
     if (this->isNodeGroup()) local_tps_lock.unlock();
+    directory.insertSubtree(node);
     if (node->type == Node<Data>::CachedBoundary) {
       CkPrintf("local_tps used for a non TP node!\n");
     }
@@ -259,27 +942,127 @@ void CacheManager<Data>::insertNode(Node<Data>* node, bool above_tp, bool should
   CkPrintf("inserting node %d of type %d with %d children\n", node->key, node->type, node->n_children);
 #endif
   for (int i = 0; i < node->n_children; i++) {
-    Node<Data>* new_child;
-    Key child_key = (node->key << LOG_BRANCH_FACTOR) + i;
-    bool add_placeholder = false;
-    if (above_tp) {
-      auto it = local_tps.find(child_key);
-      if (it != local_tps.end()) {
-        new_child = it->second;
-        new_child->parent = node;
-      }
+    Node<Data>* new_child = makeChild(node, i, above_tp);
+    node->children[i].store(new_child);
+    directory.insert(new_child->key, new_child);
+  }
+  if (should_swap) swapIn(node);
+}
+
+template <typename Data>
+Node<Data>* CacheManager<Data>::makeChild(Node<Data>* node, int i, bool above_tp) {
+  Key child_key = (node->key << LOG_BRANCH_FACTOR) + i;
+  if (above_tp) {
+    auto it = local_tps.find(child_key);
+    if (it != local_tps.end()) {
+      it->second->parent = node;
+      return it->second;
+    }
+  }
+  Node<Data>* new_child = new Node<Data> (child_key, node->depth+1, 0, nullptr, 0, 0, node);
+  new_child->type = (above_tp) ? Node<Data>::RemoteAboveTPKey : Node<Data>::Remote;
+  if (!above_tp) new_child->cm_index = node->cm_index;
+  // traversals skip empty leaves, so empty octants are never fetched;
+  // nothing would read a count on a non-empty placeholder, which is
+  // fetched whatever its size
+  if (countUnder(child_key) == 0) new_child->type = Node<Data>::RemoteEmptyLeaf;
+  return new_child;
+}
+
+template <typename Data>
+void CacheManager<Data>::pruneTop() {
+  // free everything below the CachedBoundary nodes; local subtrees are
+  // already unhooked
+  std::vector<Node<Data>*> stack (1, root);
+  while (stack.size()) {
+    Node<Data>* node = stack.back();
+    stack.pop_back();
+    for (int i = 0; i < node->n_children; i++) {
+      Node<Data>* child = node->children[i].load();
+      if (child == nullptr) continue;
+      if (child->type == Node<Data>::CachedBoundary) stack.push_back(child);
       else {
-        add_placeholder = true;
+        child->triggerFree();
+        delete child;
+        node->children[i].store(nullptr);
       }
     }
-    if (!above_tp || add_placeholder) {
-      new_child = new Node<Data> (child_key, node->depth+1, 0, nullptr, 0, 0, node);
-      new_child->type = (above_tp) ? Node<Data>::RemoteAboveTPKey : Node<Data>::Remote;
-      if (!above_tp) new_child->cm_index = node->cm_index;
+  }
+}
+
+template <typename Data>
+void CacheManager<Data>::refreshTop() {
+  // below a kept top tree, hook in this build's local subtrees and put
+  // placeholders with current occupancy everywhere else
+  if (root == nullptr || root->type != Node<Data>::CachedBoundary) return;
+  std::vector<Node<Data>*> stack (1, root);
+  while (stack.size()) {
+    Node<Data>* node = stack.back();
+    stack.pop_back();
+    for (int i = 0; i < node->n_children; i++) {
+      Node<Data>* child = node->children[i].load();
+      Key child_key = (node->key << LOG_BRANCH_FACTOR) + i;
+      if (child && child->type == Node<Data>::CachedBoundary && !local_tps.count(child_key)) {
+        stack.push_back(child);
+        continue;
+      }
+      if (child) {
+        // the key became local, what was cached for it is stale
+        child->triggerFree();
+        delete child;
+      }
+      Node<Data>* new_child = makeChild(node, i, true);
+      node->children[i].store(new_child);
+      directory.insert(child_key, new_child);
     }
-    node->children[i].store(new_child);
   }
-  if (should_swap) swapIn(node);
+}
+
+template <typename Data>
+void CacheManager<Data>::mergeLocalTrees() {
+  // build local Internal nodes above every group of BRANCH_FACTOR sibling
+  // subtrees that are all resident here, so traversals never treat
+  // co-located TreePieces as remote; the global root is left to the cache
+  bool merged_any = true;
+  while (merged_any) {
+    merged_any = false;
+    std::unordered_map<Key, int> n_local;
+    for (auto& local_tp : local_tps) {
+      Key parent_key = local_tp.first >> LOG_BRANCH_FACTOR;
+      if (parent_key > 1 && !local_tps.count(parent_key)) n_local[parent_key]++;
+    }
+    for (auto& candidate : n_local) {
+      if (candidate.second != BRANCH_FACTOR) continue;
+      Key key = candidate.first;
+      Node<Data>* node = new Node<Data>(key, Node<Data>::Internal, Data(), BRANCH_FACTOR, nullptr);
+      for (int i = 0; i < BRANCH_FACTOR; i++) {
+        Node<Data>* child = local_tps[(key << LOG_BRANCH_FACTOR) + i];
+        node->depth = child->depth - 1;
+        node->data += child->data;
+        node->n_particles += child->n_particles;
+        child->parent = node;
+        node->children[i].store(child);
+      }
+      // TreePieces are numbered in key order, so the ones underneath are
+      // the range from the first child's to the last child's
+      Node<Data>* first = node->children[0].load();
+      Node<Data>* last = node->children[BRANCH_FACTOR - 1].load();
+      node->owner_tp_start = (first->tp_index >= 0) ? first->tp_index : first->owner_tp_start;
+      node->owner_tp_end = (last->tp_index >= 0) ? last->tp_index : last->owner_tp_end;
+      node->tp_index = -1; // spans several TreePieces, as a Boundary node does
+      local_tps.insert(std::make_pair(key, node));
+      merged_tops.push_back(node);
+      directory.insert(key, node);
+      merged_any = true;
+    }
+  }
+}
+
+template <typename Data>
+Node<Data>* CacheManager<Data>::findNode(Key key) {
+  Node<Data>* node = directory.find(key);
+  if (node == nullptr && root != nullptr) node = root->findNode(key);
+  return node;
 }
 
 template <typename Data>
@@ -2,6 +2,7 @@
 #define SIMPLE_CENTROIDDATA_H_
 
 #include "common.h"
+#include <cmath>
 #include <vector>
 #include <queue>
 #include "Particle.h"
@@ -61,6 +62,18 @@ struct CentroidData {
   Vector3D<Real> getCentroid() const {
     return moment / sum_mass;
   }
+
+  // whether cd is far enough from this to be worth propagating, relative
+  // to the mass and radius of this
+  bool differs(const CentroidData& cd, Real tolerance) const {
+    if (count != cd.count) return true;
+    if (count == 0) return false;
+    if (std::abs(sum_mass - cd.sum_mass) > tolerance * sum_mass) return true;
+    Real radius = std::sqrt(rsq);
+    if ((getCentroid() - cd.getCentroid()).length() > tolerance * radius) return true;
+    if ((box.lesser_corner - cd.box.lesser_corner).length() > tolerance * radius) return true;
+    return (box.greater_corner - cd.box.greater_corner).length() > tolerance * radius;
+  }
 };
 
 #endif // SIMPLE_CENTROID_H_
@@ -10,6 +10,8 @@ struct Config {
   int max_particles_per_leaf;
   int decomp_type;
   int tree_type;
+  std::string save_index; // directory to write the built tree to
+  std::string load_index; // directory to restore the tree from
 
   void pup (PUP::er& p) {
     p | input_file;
@@ -18,6 +20,8 @@ struct Config {
     p | max_particles_per_leaf;
     p | decomp_type;
     p | tree_type;
+    p | save_index;
+    p | load_index;
   }
 };
 
@@ -7,6 +7,9 @@
 #include <vector>
 
 #include <numeric>
+#include <cstdio>
+#include <sys/stat.h>
+#include "Config.h"
 #include "Reader.h"
 #include "Splitter.h"
 #include "TreePiece.h"
@@ -21,6 +24,7 @@
 #include "CacheManager.h"
 #include "CountManager.h"
 #include "Resumer.h"
+#include "ArrayMaps.h"
 
 extern CProxy_Reader readers;
 extern int n_readers;
@@ -31,50 +35,64 @@ extern int decomp_type;
 extern int tree_type;
 extern int num_iterations;
 extern int flush_period;
-extern CProxy_TreeElement<CentroidData> centroid_calculator;
+extern bool use_refit;
+extern CProxy_TreePieceMap tp_map;
+extern CProxy_TreeElementMap te_map;
 extern CProxy_CacheManager<CentroidData> centroid_cache;
 extern CProxy_Resumer<CentroidData> centroid_resumer;
 extern CProxy_CountManager count_manager;
 extern CProxy_Driver<CentroidData> centroid_driver;
 
-template <typename Data>
-struct Comparator {
-  bool operator() (const std::pair<Key, Data>& a, const std::pair<Key, Data>& b) {return a.first < b.first;}
-};
-
 template <typename Data>
 class Driver : public CBase_Driver<Data> {
 public:
   CProxy_CacheManager<Data> cache_manager;
-  std::vector<std::pair<Key, Data>> storage;
-  bool storage_sorted;
 
-  Driver(CProxy_CacheManager<Data> cache_manageri) : cache_manager(cache_manageri), storage_sorted(false) {}
+  Driver(CProxy_CacheManager<Data> cache_manageri) : cache_manager(cache_manageri) {}
 
   void countInts(int* intrn_counts) {
     CkPrintf("%d node-part interactions, %d part-part interactions\n", intrn_counts[0], intrn_counts[1] / 2);
   }
 
-  void recvTE(std::pair<Key, Data> param) {
-    storage.emplace_back(param);
-  }
-  void loadCache(CkCallback cb) {
-    CkPrintf("Broadcasting top %d levels to caches\n", num_share_levels);
-    Comparator<Data> comp;
-    std::sort(storage.begin(), storage.end(), comp);
-    int send_size = storage.size();
-    if (num_share_levels >= 0) {
-      std::pair<Key, Data> to_search (1 << (LOG_BRANCH_FACTOR * num_share_levels), Data());
-      send_size = std::lower_bound(storage.begin(), storage.end(), to_search, comp) - storage.begin();
-    }
-    cache_manager.recvStarterPack(storage.data(), send_size, cb);
-  }
-
-  void load(Config config, CkCallback cb) {
+  void load(Config configi, CkCallback cb) {
     total_start_time = CkWallTimer();
-    makeNewTree(0);
+    config = configi;
+    if (config.load_index.size()) loadIndex();
+    else makeNewTree(0);
     cb.send();
   }
+  // restore the tree written by saveIndex, with no loading, decomposition,
+  // sorting or building
+  void loadIndex() {
+    start_time = CkWallTimer();
+    FILE* fp = fopen((config.load_index + "/meta").c_str(), "rb");
+    if (fp == nullptr) CkAbort("Driver::loadIndex: cannot open index meta file");
+    PUP::fromDisk p (fp);
+    p | universe;
+    p | splitters;
+    fclose(fp);
+    n_treepieces = splitters.size();
+    // Readers hold no particles here, this only hands them the universe
+    readers.assignKeys(universe, CkCallbackResumeThread());
+    readers.setSplitters(splitters, CkCallbackResumeThread());
+    placeTreePieces(0);
+    treepieces.loadIndex(config.load_index, CkCallbackResumeThread());
+    splitters.resize(0);
+    tree_loaded = true;
+    CkPrintf("[Driver] Loading tree index: %lf seconds\n", CkWallTimer() - start_time);
+  }
+  void saveIndex() {
+    start_time = CkWallTimer();
+    mkdir(config.save_index.c_str(), 0755);
+    FILE* fp = fopen((config.save_index + "/meta").c_str(), "wb");
+    if (fp == nullptr) CkAbort("Driver::saveIndex: cannot open index meta file");
+    PUP::toDisk p (fp);
+    p | universe;
+    p | readers.ckLocalBranch()->splitters;
+    fclose(fp);
+    treepieces.saveIndex(config.save_index, CkCallbackResumeThread());
+    CkPrintf("[Driver] Saving tree index: %lf seconds\n", CkWallTimer() - start_time);
+  }
   void makeNewTree(int it) {
     // useful particle keys
     smallest_particle_key = Utility::removeLeadingZeros(Key(1));
@@ -108,12 +126,7 @@ public:
     std::sort(splitters.begin(), splitters.end());
     CkPrintf("[Driver, %d] Finding and sorting splitters: %lf seconds\n", it, CkWallTimer() - start_time);
     readers.setSplitters(splitters, CkCallbackResumeThread());
-    
-    // create treepieces
-    CkWaitQD();
-    treepieces = CProxy_TreePiece<CentroidData>::ckNew(CkCallbackResumeThread(), universe.n_particles, n_treepieces, centroid_calculator, centroid_resumer, centroid_cache, centroid_driver, n_treepieces);
-    CkWaitQD();
-    CkPrintf("[Driver, %d] Created %d TreePieces\n", it, n_treepieces);
+    placeTreePieces(it);
 
     // flush particles to home TreePieces
     start_time = CkWallTimer();
@@ -130,79 +143,69 @@ public:
     splitters.resize(0);
 
   }
-
-  void sortStorage() {
-    Comparator<Data> comp;
-    std::sort(storage.begin(), storage.end(), comp);
-    storage_sorted = true;
-  }
-
-  template <typename Visitor>
-  void prefetch(Data nodewide_data, int cm_index, TEHolder<Data> te_holder, CkCallback cb) {
-    // do traversal on the root, send everything
-    if (!storage_sorted) sortStorage();
-    std::queue<int> node_indices; // better for cache. plus no requirement here on order
-    node_indices.push(0);
-    std::vector<std::pair<Key, Data>> to_send;
-    Visitor v;
-    Comparator<Data> comp;
-    typename std::vector<std::pair<Key, Data> >::iterator it;
-
-    while (node_indices.size()) {
-      std::pair<Key, Data> node = storage[node_indices.front()];
-      node_indices.pop();
-      to_send.push_back(node);
-
-      Node<Data> dummy_node1, dummy_node2;
-      dummy_node1.data = node.second;
-      dummy_node2.data = nodewide_data;
-      if (v.cell(SourceNode<Data>(&dummy_node1), TargetNode<Data>(&dummy_node2))) {
-
-        for (int i = 0; i < BRANCH_FACTOR; i++) {
-          Key key = node.first * BRANCH_FACTOR + i;
-          it = std::lower_bound(storage.begin(), storage.end(), std::make_pair(key, Data()), comp);
-          if (it != storage.end() && it->first == key) {
-            node_indices.push(it - storage.begin());
-          }
-        }
-      }
+  void placeTreePieces(int it) {
+    // TreeElements are placed by the splitters, so they are recreated with them
+    if (it > 0) tree_elements.ckDestroy();
+    CkArrayOptions te_opts;
+    te_opts.setMap(te_map);
+    tree_elements = CProxy_TreeElement<CentroidData>::ckNew(te_opts);
+
+    // create treepieces the first time, later only add or remove the
+    // difference and hand the new decomposition to the ones kept
+    CkWaitQD();
+    if (it == 0) {
+      CkArrayOptions tp_opts (n_treepieces);
+      tp_opts.setMap(tp_map);
+      treepieces = CProxy_TreePiece<CentroidData>::ckNew(centroid_resumer, centroid_cache, tp_opts);
+      CkWaitQD();
     }
-    cache_manager[cm_index].recvStarterPack(to_send.data(), to_send.size(), cb);
-  }
-  void request(Key* request_list, int list_size, int cm_index, TEHolder<Data> te_holder, CkCallback cb) {
-    if (!storage_sorted) sortStorage();
-    Comparator<Data> comp;
-    typename std::vector<std::pair<Key, Data> >::iterator it;
-    std::vector<std::pair<Key, Data>> to_send;
-    for (int i = 0; i < list_size; i++) {
-      Key key = request_list[i];
-      it = std::lower_bound(storage.begin(), storage.end(), std::make_pair(key, Data()), comp);
-      if (it != storage.end() && it->first == key) {
-        to_send.push_back(*it);
-      }
+    else if (n_treepieces != n_live_treepieces) {
+      for (int i = n_live_treepieces; i < n_treepieces; i++) treepieces[i].insert(centroid_resumer, centroid_cache);
+      for (int i = n_treepieces; i < n_live_treepieces; i++) treepieces[i].ckDestroy();
+      treepieces.doneInserting();
+      CkWaitQD();
     }
-    cache_manager[cm_index].recvStarterPack(to_send.data(), to_send.size(), cb);
+    n_live_treepieces = n_treepieces;
+    treepieces.reset(CkCallbackResumeThread(), universe.n_particles, n_treepieces, tree_elements);
+    if (it == 0) centroid_cache.sizeDirectory(universe.n_particles, CkCallbackResumeThread());
+    CkPrintf("[Driver, %d] Set up %d TreePieces\n", it, n_treepieces);
   }
 
   void run(CkCallback cb, int num_iterations) {
+    bool new_treepieces = true;
     for (int it = 0; it < num_iterations; it++) {
       // start local tree build in TreePieces
       start_time = CkWallTimer();
-      treepieces.build(true);
-      CkWaitQD();
+      if (tree_loaded) tree_loaded = false; // restored by loadIndex
+      else if (use_refit && !new_treepieces) treepieces.refit(CkCallbackResumeThread());
+      else treepieces.build(true, CkCallbackResumeThread());
+      new_treepieces = false;
       CkPrintf("[Driver, %d] Local tree build: %lf seconds\n", it, CkWallTimer() - start_time);
+      if (it == 0 && config.save_index.size()) saveIndex();
+#if BOTTOM_UP_BUILD
+      CkReductionMsg* build_msg;
+      treepieces.benchBuild(CkCallbackResumeThread((void*&)build_msg));
+      double* build_times = (double*)build_msg->getData();
+      CkPrintf("[Driver, %d] Local subtree build, summed over TreePieces: top-down %lf seconds, bottom-up %lf seconds\n", it, build_times[0], build_times[1]);
+      delete build_msg;
+#endif
+#if FLATTREE
+      CkReductionMsg* walk_msg;
+      treepieces.template benchLocalWalk<DensityVisitor>(CkCallbackResumeThread((void*&)walk_msg));
+      double* walk_times = (double*)walk_msg->getData();
+      CkPrintf("[Driver, %d] Local tree walk: pointer %lf seconds, flat %lf seconds\n", it, walk_times[0], walk_times[1]);
+      delete walk_msg;
+#endif
+      // with COLLECTIVE_TOP the top tree was assembled during the build,
+      // this only waits for it
       start_time = CkWallTimer();
-      centroid_cache.startParentPrefetch(this->thisProxy, centroid_calculator, CkCallback::ignore);
-      //centroid_cache.template startPrefetch<GravityVisitor>(this->thisProxy, centroid_calculator, CkCallback::ignore);
-      //centroid_driver.loadCache(CkCallbackResumeThread());
-      CkWaitQD();
+      centroid_cache.startParentPrefetch(CkCallbackResumeThread());
       CkPrintf("[Driver, %d] TE cache loading: %lf seconds\n", it, CkWallTimer() - start_time);
 
       // perform downward and upward traversals (Barnes-Hut)
       start_time = CkWallTimer();
       //treepieces.template startDown<GravityVisitor>();
-      treepieces.template startUpAndDown<DensityVisitor>();
-      CkWaitQD();
+      treepieces.template startUpAndDown<DensityVisitor>(CkCallbackResumeThread());
 #if DELAYLOCAL
       //treepieces.processLocal(CkCallbackResumeThread());
 #endif
@@ -213,23 +216,31 @@ public:
       //count_manager.sum(CkCallback(CkReductionTarget(Main, terminate), thisProxy));
       start_time = CkWallTimer();
       bool complete_rebuild = (it % flush_period == flush_period-1);
-      treepieces.perturb(0.1, complete_rebuild); // 0.1s for example
-      CkWaitQD();
+      treepieces.perturb(0.1, complete_rebuild, CkCallbackResumeThread()); // 0.1s for example
       CkPrintf("[Driver, %d] Perturbations done: %lf seconds\n", it, CkWallTimer() - start_time);
       if (complete_rebuild) {
-        treepieces.ckDestroy();
         makeNewTree(it+1);
+        new_treepieces = true;
       }
-      centroid_cache.destroy(true);
-      centroid_resumer.destroy();
-      storage.resize(0);
-      storage_sorted = false;
-      CkWaitQD();
+      CkReductionMsg* cache_msg;
+      centroid_cache.reset(new_treepieces, CkCallbackResumeThread((void*&)cache_msg));
+      long long* cache_counts = (long long*)cache_msg->getData();
+      if (cache_counts[0] > 0) {
+        CkPrintf("[Driver, %d] Cache evictions: %lld subtrees, %lld fetched again\n", it, cache_counts[0], cache_counts[1]);
+      }
+      if (cache_counts[2] + cache_counts[3] > 0) {
+        CkPrintf("[Driver, %d] Node lookup cache: %lld hits, %lld misses (%.1lf%%)\n", it, cache_counts[2], cache_counts[3],
+            100.0 * cache_counts[2] / (cache_counts[2] + cache_counts[3]));
+      }
+      delete cache_msg;
+      centroid_resumer.destroy(CkCallbackResumeThread());
     }
     cb.send();
   }
 
 private:
+  Config config;
+  bool tree_loaded = false;
   double total_start_time;
   double start_time;
   BoundingBox universe;
@@ -239,7 +250,9 @@ private:
   std::vector<Splitter> splitters;
 
   CProxy_TreePiece<CentroidData> treepieces; // cannot be a global variable
+  CProxy_TreeElement<CentroidData> tree_elements;
   int n_treepieces;
+  int n_live_treepieces = 0;
 
   void findOctSplitters() {
     BufferedVec<Key> keys;
@@ -267,35 +280,19 @@ private:
 
         int n_particles = counts[i];
         if ((Real)n_particles > threshold) {
-          // create 8 more splitter key pairs to go one level deeper
+          // create BRANCH_FACTOR more splitter key pairs to go one level deeper
           // leading zeros will be removed in Reader::count()
           // to compare splitter key with particle keys
-          keys.add(from << 3);
-          keys.add((from << 3) + 1);
-
-          keys.add((from << 3) + 1);
-          keys.add((from << 3) + 2);
-
-          keys.add((from << 3) + 2);
-          keys.add((from << 3) + 3);
-
-          keys.add((from << 3) + 3);
-          keys.add((from << 3) + 4);
-
-          keys.add((from << 3) + 4);
-          keys.add((from << 3) + 5);
-
-          keys.add((from << 3) + 5);
-          keys.add((from << 3) + 6);
-
-          keys.add((from << 3) + 6);
-          keys.add((from << 3) + 7);
+          for (int j = 0; j < BRANCH_FACTOR - 1; j++) {
+            keys.add((from << LOG_BRANCH_FACTOR) + j);
+            keys.add((from << LOG_BRANCH_FACTOR) + j + 1);
+          }
 
-          keys.add((from << 3) + 7);
+          keys.add((from << LOG_BRANCH_FACTOR) + BRANCH_FACTOR - 1);
           if (to == (~Key(0)))
             keys.add(~Key(0));
           else
-            keys.add(to << 3);
+            keys.add(to << LOG_BRANCH_FACTOR);
         }
         else {
           // create and store splitter
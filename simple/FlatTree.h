@@ -0,0 +1,108 @@
+#ifndef SIMPLE_FLATTREE_H_
+#define SIMPLE_FLATTREE_H_
+
+#include "common.h"
+#include "Node.h"
+#include "Particle.h"
+#include <vector>
+#include <stack>
+
+/*
+ * FlatTree:
+ * Pointer-free copy of a TreePiece's local tree, laid out contiguously in
+ * DFS order. The first child of node i is always at i + 1, and skip[i] is
+ * the index right after i's subtree, so a walk only needs to choose between
+ * i + 1 (open) and skip[i] (do not open). Fields read on every visit are kept
+ * in the hot arrays; the cold array maps back to the owning Node, and each
+ * Node keeps its own index so walks can start from it without a lookup.
+ */
+template <typename Data>
+struct FlatTree {
+  // hot
+  std::vector<Key> keys;
+  std::vector<typename Node<Data>::Type> types;
+  std::vector<int> skip;
+  std::vector<Data> data;
+  std::vector<int> depths;
+  std::vector<int> n_particles;
+  std::vector<Particle*> particles;
+  // cold
+  std::vector<Node<Data>*> nodes;
+
+  void clear() {
+    keys.resize(0);
+    types.resize(0);
+    skip.resize(0);
+    data.resize(0);
+    depths.resize(0);
+    n_particles.resize(0);
+    particles.resize(0);
+    nodes.resize(0);
+  }
+
+  int size() const {
+    return keys.size();
+  }
+
+  void build(Node<Data>* root) {
+    clear();
+    if (root == nullptr) return;
+    // (node, index of its entry) - second is -1 on the way down
+    std::stack<std::pair<Node<Data>*, int>> stack;
+    stack.push(std::make_pair(root, -1));
+    while (stack.size()) {
+      Node<Data>* node = stack.top().first;
+      int idx = stack.top().second;
+      stack.pop();
+      if (idx >= 0) {
+        skip[idx] = size();
+        continue;
+      }
+      idx = size();
+      keys.push_back(node->key);
+      types.push_back(node->type);
+      skip.push_back(-1);
+      data.push_back(node->data);
+      depths.push_back(node->depth);
+      n_particles.push_back(node->n_particles);
+      particles.push_back(node->particles);
+      nodes.push_back(node);
+      node->flat_index = idx;
+      stack.push(std::make_pair(node, idx));
+      if (node->type == Node<Data>::Internal) {
+        for (int i = node->n_children - 1; i >= 0; i--) {
+          Node<Data>* child = node->children[i].load();
+          if (child) stack.push(std::make_pair(child, -1));
+        }
+      }
+    }
+  }
+
+  // index of a node of this tree, -1 if it is not part of it
+  int find(const Node<Data>* node) const {
+    int i = node->flat_index;
+    return (i >= 0 && i < size() && nodes[i] == node) ? i : -1;
+  }
+
+  // walks the subtree at index i: internal nodes are opened if open(j)
+  // accepts them and passed to pruned(j) otherwise, leaves go to leaf(j)
+  template <typename OpenFn, typename LeafFn, typename PrunedFn>
+  void walk(int i, OpenFn open, LeafFn leaf, PrunedFn pruned) const {
+    int end = skip[i];
+    while (i < end) {
+      if (types[i] == Node<Data>::Internal) {
+        if (open(i)) i++;
+        else {
+          pruned(i);
+          i = skip[i];
+        }
+      }
+      else {
+        if (types[i] == Node<Data>::Leaf) leaf(i);
+        i = skip[i];
+      }
+    }
+  }
+};
+
+#endif // SIMPLE_FLATTREE_H_
@@ -24,8 +24,8 @@ struct Node {
   int wait_count;
   int tp_index;
   int cm_index;
+  int flat_index; // entry in the owning TreePiece's FlatTree, local only
   std::atomic<bool> requested;
-  std::vector<Vector3D<Real> > sum_forces;
 
   void pup (PUP::er& p) {
     pup_bytes(&p, (void *)&type, sizeof(Type));
@@ -41,6 +41,7 @@ struct Node {
     p | cm_index;
     if (p.isUnpacking()) {
       particles = nullptr;
+      flat_index = -1;
     }
   }
 
@@ -57,21 +58,22 @@ struct Node {
     this->key = key;
     this->depth = depth;
     this->n_particles = n_particles;
-    this->sum_forces.resize(this->n_particles, Vector3D<Real>(0,0,0));
     this->particles = particles;
     this->data = Data();
     this->owner_tp_start = owner_tp_start;
     this->owner_tp_end = owner_tp_end;
     this->parent = parent;
     this->n_children = 0;
-    this->wait_count = 8;
+    this->wait_count = BRANCH_FACTOR;
     this->tp_index = tp_indexi;
     this->cm_index = -1;
+    this->flat_index = -1;
     for (int i = 0; i < BRANCH_FACTOR; i++) this->children[i].store(nullptr);
     this->requested.store(false);
   }
   Node (const Node& n) {
     *this = n;
+    requested.store(false);
   }
   Node& operator= (const Node& n) {
     type = n.type;
@@ -80,7 +82,6 @@ struct Node {
     data = n.data;
     n_particles = n.n_particles;
     particles = n.particles;
-    sum_forces = n.sum_forces;
     owner_tp_start = n.owner_tp_start;
     owner_tp_end = n.owner_tp_end;
     parent = n.parent;
@@ -88,7 +89,9 @@ struct Node {
     wait_count = n.wait_count;
     tp_index = n.tp_index;
     cm_index = n.cm_index;
+    flat_index = -1;
     for (int i = 0; i < BRANCH_FACTOR; i++) this->children[i].store(nullptr);
+    return *this;
   }
 
   void triggerFree() {
@@ -148,19 +151,23 @@ struct Node {
     }
   }
   Node* findNode(Key to_find) {
-    std::vector<int> remainders;
-    Key temp = to_find;
-    while (temp >= 8 * key) {
-      remainders.push_back(temp % 8);
-      temp /= 8;
-    }
+    int levels = 0;
+    for (Key temp = to_find; temp >= BRANCH_FACTOR * key; temp >>= LOG_BRANCH_FACTOR) levels++;
+    if ((to_find >> (levels * LOG_BRANCH_FACTOR)) != key) return nullptr;
     Node<Data>* node = this;
-    for (int i = remainders.size()-1; i >= 0; i--) {
-      if (node && remainders[i] < node->children.size()) node = node->children[remainders[i]].load();
-      else return nullptr;
+    for (int i = levels - 1; node && i >= 0; i--) {
+      node = node->children[(to_find >> (i * LOG_BRANCH_FACTOR)) % BRANCH_FACTOR].load();
     }
     return node;
   }
 };
 
+// request for a remote node and the levels below it to ship back
+struct NodeRequest {
+  Key key;
+  int cm_index; // requesting CacheManager
+  int depth;
+};
+PUPbytes(NodeRequest)
+
 #endif // SIMPLE_NODE_H_
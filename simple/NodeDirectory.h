@@ -0,0 +1,126 @@
+#ifndef SIMPLE_NODEDIRECTORY_H_
+#define SIMPLE_NODEDIRECTORY_H_
+
+#include "common.h"
+#include "Node.h"
+#include <atomic>
+#include <memory>
+
+/*
+ * NodeDirectory:
+ * Key to node index with open addressing and linear probing, so lookups by
+ * key need neither a descent from the root nor any allocation. The table is
+ * sized up front and only grows on reset; inserts into a full table fail and the
+ * caller falls back to Node::findNode. Inserts and lookups may run
+ * concurrently (CacheManager is a nodegroup): a slot is claimed by swapping
+ * its node pointer from null to a marker, then the key is written and the
+ * node published.
+ */
+template <typename Data>
+class NodeDirectory {
+public:
+  NodeDirectory() : capacity(0), n_entries(0) {}
+
+  // empties the directory, growing it to fit expected entries; not thread
+  // safe, call while no one else is using the directory
+  void reset(int expected) {
+    int new_capacity = 1024;
+    while (new_capacity < 2 * expected) new_capacity <<= 1;
+    if (new_capacity > capacity) {
+      capacity = new_capacity;
+      slots.reset(new Slot[capacity]);
+    }
+    for (int i = 0; i < capacity; i++) slots[i].node.store(nullptr, std::memory_order_relaxed);
+    n_entries.store(0);
+  }
+
+  // insert, or repoint an existing key at a new node
+  bool insert(Key key, Node<Data>* node) {
+    if (!capacity) return false;
+    for (int probe = 0, i = slot(key); probe < capacity; probe++, i = (i + 1) & (capacity - 1)) {
+      Node<Data>* current = slots[i].node.load(std::memory_order_acquire);
+      if (current == nullptr) {
+        if (n_entries.load(std::memory_order_relaxed) >= capacity - capacity / 4) return false;
+        if (slots[i].node.compare_exchange_strong(current, claimed(), std::memory_order_acq_rel)) {
+          slots[i].key = key;
+          slots[i].node.store(node, std::memory_order_release);
+          n_entries++;
+          return true;
+        }
+      }
+      if (current != claimed() && slots[i].key == key) {
+        slots[i].node.store(node, std::memory_order_release);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  Node<Data>* find(Key key) const {
+    if (!capacity) return nullptr;
+    for (int probe = 0, i = slot(key); probe < capacity; probe++, i = (i + 1) & (capacity - 1)) {
+      Node<Data>* current = slots[i].node.load(std::memory_order_acquire);
+      if (current == nullptr) return nullptr;
+      if (current != claimed() && slots[i].key == key) return (current == removed()) ? nullptr : current;
+    }
+    return nullptr;
+  }
+
+  // keeps the slot so probe sequences stay intact, a later insert of the
+  // same key reuses it
+  void remove(Key key) {
+    if (!capacity) return;
+    for (int probe = 0, i = slot(key); probe < capacity; probe++, i = (i + 1) & (capacity - 1)) {
+      Node<Data>* current = slots[i].node.load(std::memory_order_acquire);
+      if (current == nullptr) return;
+      if (current != claimed() && slots[i].key == key) {
+        slots[i].node.store(removed(), std::memory_order_release);
+        return;
+      }
+    }
+  }
+
+  // index every node of a subtree
+  void insertSubtree(Node<Data>* root) {
+    std::vector<Node<Data>*> stack (1, root);
+    while (stack.size()) {
+      Node<Data>* node = stack.back();
+      stack.pop_back();
+      insert(node->key, node);
+      for (int i = 0; i < node->n_children; i++) {
+        Node<Data>* child = node->children[i].load();
+        if (child) stack.push_back(child);
+      }
+    }
+  }
+
+  int size() const {
+    return n_entries.load();
+  }
+
+private:
+  struct Slot {
+    Key key;
+    std::atomic<Node<Data>*> node;
+  };
+
+  int capacity;
+  std::atomic<int> n_entries;
+  std::unique_ptr<Slot[]> slots;
+
+  static Node<Data>* claimed() {
+    return reinterpret_cast<Node<Data>*>(uintptr_t(1));
+  }
+
+  static Node<Data>* removed() {
+    return reinterpret_cast<Node<Data>*>(uintptr_t(2));
+  }
+
+  int slot(Key key) const {
+    uint64_t h = uint64_t(key) ^ uint64_t(key >> (KEY_BITS / 2));
+    h *= 0x9E3779B97F4A7C15ULL;
+    return int(h >> 32) & (capacity - 1);
+  }
+};
+
+#endif // SIMPLE_NODEDIRECTORY_H_
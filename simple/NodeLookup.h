@@ -0,0 +1,148 @@
+#ifndef SIMPLE_NODELOOKUP_H_
+#define SIMPLE_NODELOOKUP_H_
+
+#include "common.h"
+#include "Node.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <vector>
+
+/*
+ * NodeLookup:
+ * Fixed-size cache of key to node lookups that missed the NodeDirectory,
+ * shared by every PE using a CacheManager. Keys hash to a bucket of WAYS
+ * node pointers that fills one cache line, and a full bucket replaces by
+ * CLOCK over its reference bits. Only node pointers are stored, the key is
+ * read back from the node, so finds and inserts are single atomic loads and
+ * stores with no locking. Hits and misses are counted per rank of the
+ * caller. Entries must be cleared before their nodes are freed.
+ */
+template <typename Data>
+class NodeLookup {
+public:
+  NodeLookup() : n_buckets(0), buckets(nullptr), counts(1) {}
+
+  // resizes to hold about n_entries for n_ranks callers, dropping all
+  // entries; not thread safe
+  void resize(int n_entries, int n_ranks = 1) {
+    if (n_ranks > (int)counts.size()) counts.resize(n_ranks);
+    int new_buckets = 1;
+    while (new_buckets * WAYS < n_entries) new_buckets <<= 1;
+    if (new_buckets != n_buckets) {
+      n_buckets = new_buckets;
+      storage.reset(new char[(n_buckets + 1) * sizeof(Bucket)]);
+      uintptr_t aligned = (reinterpret_cast<uintptr_t>(storage.get()) + sizeof(Bucket) - 1) & ~uintptr_t(sizeof(Bucket) - 1);
+      buckets = reinterpret_cast<Bucket*>(aligned);
+      for (int b = 0; b < n_buckets; b++) new (&buckets[b]) Bucket();
+    }
+    clear();
+  }
+
+  // drops all entries; not thread safe
+  void clear() {
+    for (int b = 0; b < n_buckets; b++) {
+      for (int i = 0; i < WAYS; i++) buckets[b].nodes[i].store(nullptr, std::memory_order_relaxed);
+      buckets[b].referenced.store(0, std::memory_order_relaxed);
+      buckets[b].hand.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  Node<Data>* find(Key key, int rank = 0) {
+    if (!n_buckets) return nullptr;
+    Bucket& bucket = buckets[index(key)];
+    for (int i = 0; i < WAYS; i++) {
+      Node<Data>* node = bucket.nodes[i].load(std::memory_order_acquire);
+      if (node && node->key == key) {
+        uint8_t mask = uint8_t(1 << i);
+        if (!(bucket.referenced.load(std::memory_order_relaxed) & mask)) {
+          bucket.referenced.fetch_or(mask, std::memory_order_relaxed);
+        }
+        counts[rank].hits++;
+        return node;
+      }
+    }
+    counts[rank].misses++;
+    return nullptr;
+  }
+
+  void insert(Node<Data>* node) {
+    if (!n_buckets) return;
+    Bucket& bucket = buckets[index(node->key)];
+    for (int i = 0; i < WAYS; i++) {
+      Node<Data>* current = bucket.nodes[i].load(std::memory_order_acquire);
+      if (current == nullptr) {
+        if (bucket.nodes[i].compare_exchange_strong(current, node, std::memory_order_acq_rel)) return;
+      }
+      if (current && current->key == node->key) {
+        bucket.nodes[i].store(node, std::memory_order_release);
+        return;
+      }
+    }
+    // sweep the hand, giving referenced ways a second chance; after a full
+    // turn every bit is clear, so the sweep is bounded
+    for (int step = 0; step <= WAYS; step++) {
+      int way = bucket.hand.fetch_add(1, std::memory_order_relaxed) % WAYS;
+      uint8_t mask = uint8_t(1 << way);
+      if (step < WAYS && (bucket.referenced.fetch_and(uint8_t(~mask), std::memory_order_relaxed) & mask)) continue;
+      bucket.nodes[way].store(node, std::memory_order_release);
+      return;
+    }
+  }
+
+  // points an entry for the same key at a node swapped in for it, if present
+  void replace(Node<Data>* node) {
+    if (!n_buckets) return;
+    Bucket& bucket = buckets[index(node->key)];
+    for (int i = 0; i < WAYS; i++) {
+      Node<Data>* current = bucket.nodes[i].load(std::memory_order_acquire);
+      if (current && current->key == node->key) bucket.nodes[i].store(node, std::memory_order_release);
+    }
+  }
+
+  // hit and miss counts of all ranks since the last call; not thread safe
+  void takeCounts(long long& n_hits, long long& n_misses) {
+    n_hits = n_misses = 0;
+    for (auto& rank_counts : counts) {
+      n_hits += rank_counts.hits;
+      n_misses += rank_counts.misses;
+      rank_counts.hits = rank_counts.misses = 0;
+    }
+  }
+
+  int capacity() const {
+    return n_buckets * WAYS;
+  }
+
+private:
+  static const int WAYS = 7;
+
+  // seven node pointers, the reference bits and the CLOCK hand in 64 bytes
+  struct Bucket {
+    std::atomic<Node<Data>*> nodes[WAYS];
+    std::atomic<uint8_t> referenced;
+    std::atomic<uint8_t> hand;
+    char padding[64 - WAYS * sizeof(std::atomic<Node<Data>*>) - 2 * sizeof(std::atomic<uint8_t>)];
+  };
+
+  // only written by their own rank; two cache lines long, so neighbours
+  // never share a line however the vector is aligned
+  struct RankCounts {
+    long long hits = 0, misses = 0;
+    char padding[128 - 2 * sizeof(long long)];
+  };
+
+  int n_buckets;
+  Bucket* buckets; // aligned into storage
+  std::unique_ptr<char[]> storage;
+  std::vector<RankCounts> counts;
+
+  int index(Key key) const {
+    uint64_t h = uint64_t(key) ^ uint64_t(key >> (KEY_BITS / 2));
+    h *= 0x9E3779B97F4A7C15ULL;
+    return int(h >> 32) & (n_buckets - 1);
+  }
+};
+
+#endif // SIMPLE_NODELOOKUP_H_
@@ -26,7 +26,7 @@ struct Particle {
     acceleration = force / mass;
     position += (velocity * timestep);
     position += (acceleration * timestep * timestep / 2);
-    for (int dim = 0; dim < 3; dim++) {
+    for (int dim = 0; dim < NDIM; dim++) {
       if (position[dim] < universe.lesser_corner[dim]) position[dim] += universe.greater_corner[dim] - universe.lesser_corner[dim];
       else if (position[dim] > universe.greater_corner[dim]) position[dim] -= universe.greater_corner[dim] - universe.lesser_corner[dim];
     }
@@ -22,6 +22,9 @@ class Reader : public CBase_Reader {
   public:
     BoundingBox universe;
     std::vector<Splitter> splitters;
+    std::vector<Key> tp_starts; // first key of each TreePiece, outlives splitters
+    std::vector<Key> tp_keys; // subtree root of each TreePiece, outlives splitters
+    int n_placed_treepieces; // TreePiece count at the first decomposition, fixes their homes
     std::vector<Key> SFCsplitters;
     Reader();
 
@@ -33,6 +36,7 @@ class Reader : public CBase_Reader {
     // OCT decomposition
     void countOct(std::vector<Key>, const CkCallback&);
     void setSplitters(const std::vector<Splitter>&, const CkCallback&);
+    int ownerOf(Key) const;
 
     // SFC decomposition
     //void countSfc(const std::vector<Key>&, const CkCallback&);
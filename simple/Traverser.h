@@ -15,18 +15,39 @@ public:
   virtual void traverse(Key) = 0;
   virtual void processLocal() = 0;
   virtual void interact() = 0;
+  virtual bool isDone() = 0; // nothing left waiting on remote nodes
   template <typename Visitor>
   void processLocalBase(TreePiece<Data>* tp)
   {
     Visitor v;
+#if FLATTREE
+    // subtrees of other TreePieces on this PE are walked through pointers
+    const FlatTree<Data>& flat = tp->flat_tree;
+    std::vector<std::pair<Node<Data>*, int>> pointer_travs;
     for (auto local_trav : tp->local_travs) {
+      int i = flat.find(local_trav.first);
+      if (i < 0) {
+        pointer_travs.push_back(local_trav);
+        continue;
+      }
+      int bucket = local_trav.second;
+      TargetNode<Data> target (tp->leaves[bucket], tp->forcesOf(tp->leaves[bucket]));
+      flat.walk(i,
+          [&](int j) {return v.node(SourceNode<Data>(flat, j), target);},
+          [&](int j) {tp->interactions[bucket].push_back(flat.nodes[j]);},
+          [](int) {});
+    }
+#else
+    std::vector<std::pair<Node<Data>*, int>>& pointer_travs = tp->local_travs;
+#endif
+    for (auto local_trav : pointer_travs) {
       std::stack<Node<Data>*> nodes;
       nodes.push(local_trav.first);
       while (nodes.size()) {
         Node<Data>* node = nodes.top();
         nodes.pop();
         if (node->type == Node<Data>::Internal) {
-          if (v.node(SourceNode<Data>(node), TargetNode<Data>(tp->leaves[local_trav.second]))) {
+          if (v.node(SourceNode<Data>(node), TargetNode<Data>(tp->leaves[local_trav.second], tp->forcesOf(tp->leaves[local_trav.second])))) {
             for (int j = 0; j < node->n_children; j++) {
               nodes.push(node->children[j].load());
             }
@@ -44,7 +65,7 @@ public:
     Visitor v;
     for (int i = 0; i < tp->interactions.size(); i++) {
       for (Node<Data>* source : tp->interactions[i]) {
-        v.leaf(SourceNode<Data>(source), TargetNode<Data>(tp->leaves[i]));
+        v.leaf(SourceNode<Data>(source), TargetNode<Data>(tp->leaves[i], tp->forcesOf(tp->leaves[i])));
       }
     }
   }
@@ -63,6 +84,7 @@ public:
   }
   void processLocal() {this->template processLocalBase<Visitor> (tp);}
   void interact() {this->template interactBase<Visitor> (tp);}
+  bool isDone() {return curr_nodes.empty();}
   virtual void traverse(Key new_key) {
     Visitor v;
     if (new_key == 1) tp->root = tp->cache_local->root;
@@ -89,29 +111,30 @@ public:
         switch (node->type) {
           case Node<Data>::Leaf: case Node<Data>::CachedRemoteLeaf:
             tp->interactions[bucket].push_back(node);
+            tp->addCost(bucket, node->n_particles);
+            tp->cache_local->hold(node); // read again by interact()
             break;
           case Node<Data>::Internal:
 #if DELAYLOCAL
             tp->local_travs.push_back(std::make_pair(node, bucket));
             break;
+#elif FLATTREE
+            // the rest of this TreePiece's own subtree is walked flat
+            if (walkFlat(node, bucket, v)) break;
 #endif
           case Node<Data>::CachedBoundary: case Node<Data>::CachedRemote:
-            if (v.node(SourceNode<Data>(node), TargetNode<Data>(tp->leaves[bucket]))) {
+            if (v.node(SourceNode<Data>(node), TargetNode<Data>(tp->leaves[bucket], tp->forcesOf(tp->leaves[bucket])))) {
               for (int i = 0; i < node->children.size(); i++) {
                 nodes.push(node->children[i].load());
               }
             }
+            else tp->addCost(bucket, 1);
             break;
           case Node<Data>::Boundary: case Node<Data>::RemoteAboveTPKey: case Node<Data>::Remote: case Node<Data>::RemoteLeaf:
             curr_nodes_insertions.push_back(std::make_pair(node->key, bucket));
             bool prev = node->requested.exchange(true);
             if (!prev) {
-              if (node->type == Node<Data>::Boundary || node->type == Node<Data>::RemoteAboveTPKey) {
-                tp->global_data[node->key].requestData(tp->cache_local->thisIndex);
-	      }
-              else {
-		tp->cache_manager[node->cm_index].requestNodes(std::make_pair(node->key, tp->cache_local->thisIndex));
-	      }
+              tp->cache_local->queueRequest(node);
             }
             std::vector<int>& list = tp->resumer.ckLocalBranch()->waiting[node->key];
             if (!list.size() || list.back() != tp->thisIndex) list.push_back(tp->thisIndex);
@@ -121,6 +144,22 @@ public:
     curr_nodes.erase(new_key);
     for (auto cn : curr_nodes_insertions) curr_nodes[cn.first].push_back(cn.second);
   }
+
+private:
+  bool walkFlat(Node<Data>* node, int bucket, Visitor& v) {
+    const FlatTree<Data>& flat = tp->flat_tree;
+    int i = flat.find(node);
+    if (i < 0) return false;
+    TargetNode<Data> target (tp->leaves[bucket], tp->forcesOf(tp->leaves[bucket]));
+    flat.walk(i,
+        [&](int j) {return v.node(SourceNode<Data>(flat, j), target);},
+        [&](int j) {
+          tp->interactions[bucket].push_back(flat.nodes[j]);
+          tp->addCost(bucket, flat.n_particles[j]);
+        },
+        [&](int) {tp->addCost(bucket, 1);});
+    return true;
+  }
 };
 
 template <typename Data, typename Visitor>
@@ -141,6 +180,7 @@ public:
   }
   void processLocal() {CkPrintf("no need to process local traversals\n");}
   void interact() {CkPrintf("no need to perform interactions\n");}
+  bool isDone() {return curr_nodes.empty();}
 
   virtual void traverse(Key new_key) {
     Visitor v;
@@ -165,15 +205,21 @@ public:
 #endif
         switch (node->type) {
           case Node<Data>::Leaf: case Node<Data>::CachedRemoteLeaf:
-            v.leaf(SourceNode<Data>(node), TargetNode<Data>(tp->leaves[bucket]));
+            v.leaf(SourceNode<Data>(node), TargetNode<Data>(tp->leaves[bucket], tp->forcesOf(tp->leaves[bucket])));
+            tp->addCost(bucket, node->n_particles);
             break;
           case Node<Data>::Internal:
+#if FLATTREE
+            // the rest of this TreePiece's own subtree is walked flat
+            if (walkFlat(node, bucket, v)) break;
+#endif
           case Node<Data>::CachedBoundary: case Node<Data>::CachedRemote: {
-            if (v.node(SourceNode<Data>(node), TargetNode<Data>(tp->leaves[bucket]))) {
+            if (v.node(SourceNode<Data>(node), TargetNode<Data>(tp->leaves[bucket], tp->forcesOf(tp->leaves[bucket])))) {
               for (int i = 0; i < node->children.size(); i++) {
                 nodes.push(node->children[i].load());
               }
             }
+            else tp->addCost(bucket, 1);
             break;
           }
           case Node<Data>::Boundary: case Node<Data>::RemoteAboveTPKey: case Node<Data>::Remote: case Node<Data>::RemoteLeaf:
@@ -181,9 +227,7 @@ public:
             num_waiting[bucket]++;
             bool prev = node->requested.exchange(true);
             if (!prev) {
-              if (node->type == Node<Data>::Boundary || node->type == Node<Data>::RemoteAboveTPKey)
-                tp->global_data[node->key].requestData(tp->cache_local->thisIndex);
-              else tp->cache_manager[node->cm_index].requestNodes(std::make_pair(node->key, tp->cache_local->thisIndex));
+              tp->cache_local->queueRequest(node);
             }
             std::vector<int>& list = tp->resumer.ckLocalBranch()->waiting[node->key];
             if (!list.size() || list.back() != tp->thisIndex) list.push_back(tp->thisIndex);
@@ -194,7 +238,7 @@ public:
           for (int j = 0; j < BRANCH_FACTOR; j++) {
             Node<Data>* child = trav_tops[bucket]->parent->children[j].load();
             if (child == nullptr) {
-              CkPrintf("child of key %d and parent type %d is nullptr\n", trav_tops[bucket]->parent->key * 8 + j, trav_tops[bucket]->parent->type);
+              CkPrintf("child of key %d and parent type %d is nullptr\n", trav_tops[bucket]->parent->key * BRANCH_FACTOR + j, trav_tops[bucket]->parent->type);
             }
             if (child != trav_tops[bucket]) {
                if (trav_tops[bucket]->parent->type == Node<Data>::Boundary) {
@@ -213,6 +257,22 @@ public:
     curr_nodes.erase(new_key);
     for (auto cn : curr_nodes_insertions) curr_nodes[cn.first].push_back(cn.second);
   }
+
+private:
+  bool walkFlat(Node<Data>* node, int bucket, Visitor& v) {
+    const FlatTree<Data>& flat = tp->flat_tree;
+    int i = flat.find(node);
+    if (i < 0) return false;
+    TargetNode<Data> target (tp->leaves[bucket], tp->forcesOf(tp->leaves[bucket]));
+    flat.walk(i,
+        [&](int j) {return v.node(SourceNode<Data>(flat, j), target);},
+        [&](int j) {
+          v.leaf(SourceNode<Data>(flat, j), target);
+          tp->addCost(bucket, flat.n_particles[j]);
+        },
+        [&](int) {tp->addCost(bucket, 1);});
+    return true;
+  }
 };
 
 template <typename Data, typename Visitor>
@@ -229,6 +289,7 @@ public:
   }
   void processLocal () {}
   void interact() {this->template interactBase<Visitor>(tp);}
+  bool isDone() {return curr_nodes.empty();}
   virtual void traverse(Key new_key) {
     Visitor v;
     if (new_key == 1) tp->root = tp->cache_local->root;
@@ -259,12 +320,13 @@ public:
             for (int i = 0; i < tp->leaves.size(); i++) {
               if (tp->leaves[i] == currpl) {
                 tp->interactions[i].push_back(node); // needs change
+                tp->cache_local->hold(node);
                 break;
               }
             }
             break;
           case Node<Data>::Internal: case Node<Data>::CachedBoundary: case Node<Data>::CachedRemote:
-            if (v.node(SourceNode<Data>(node), TargetNode<Data>(payload))) {
+            if (v.node(SourceNode<Data>(node), TargetNode<Data>(payload, tp->forcesOf(payload)))) {
               for (int i = 0; i < node->children.size(); i++) {
                 for (int j = 0; j < payload->children.size(); j++) {
                   nodes.push(std::make_pair(node->children[i].load(), payload->children[j].load()));
@@ -276,9 +338,7 @@ public:
             curr_nodes_insertions.push_back(std::make_pair(node->key, payload));
             bool prev = node->requested.exchange(true);
             if (!prev) {
-              if (node->type == Node<Data>::Boundary || node->type == Node<Data>::RemoteAboveTPKey)
-                tp->global_data[node->key].requestData(tp->cache_local->thisIndex);
-              else tp->cache_manager[node->cm_index].requestNodes(std::make_pair(node->key, tp->cache_local->thisIndex));
+              tp->cache_local->queueRequest(node);
             }
             std::vector<int>& list = tp->resumer.ckLocalBranch()->waiting[node->key];
             if (!list.size() || list.back() != tp->thisIndex) list.push_back(tp->thisIndex);
@@ -0,0 +1,171 @@
+#ifndef SIMPLE_TREEBUILDER_H_
+#define SIMPLE_TREEBUILDER_H_
+
+#include "common.h"
+#include "Node.h"
+#include "Utility.h"
+#include <vector>
+
+/*
+ * BottomUpBuilder:
+ * Builds the local subtree under a node from its key-sorted particles in a
+ * single left-to-right scan, instead of binary searching for the children
+ * of every node. The number of tree levels shared by each pair of adjacent
+ * keys delimits the ranges of particles that share a prefix; a stack over
+ * those prefix lengths closes each range as soon as the scan leaves it, and
+ * its node is created bottom-up from the already finished child ranges.
+ * Ranges that fit in a bucket never get nodes of their own.
+ */
+template <typename Data>
+class BottomUpBuilder {
+public:
+  BottomUpBuilder(Node<Data>* rooti, int bucketi, int tp_indexi, int n_treepiecesi)
+    : root(rooti), particles(rooti->particles), n(rooti->n_particles),
+      bucket(bucketi), tp_index(tp_indexi), n_treepieces(n_treepiecesi) {}
+
+  void build(std::vector<Node<Data>*>& leaf_list, std::vector<Node<Data>*>& empty_leaf_list) {
+    if (n <= bucket || root->depth >= BITS_PER_DIM) {
+      makeLeaf(root);
+    }
+    else {
+      scan();
+      Range& range = ranges.back();
+      if (range.node != root) makeChain(root, range);
+    }
+    collectLeaves(leaf_list, empty_leaf_list);
+  }
+
+private:
+  // prefix range still open during the scan
+  struct Open {
+    int depth; // number of levels shared by all keys in the range
+    int start;
+  };
+  // finished range; node is only set for ranges larger than a bucket
+  struct Range {
+    int start;
+    int end;
+    int depth;
+    Node<Data>* node;
+  };
+
+  Node<Data>* root;
+  Particle* particles;
+  int n;
+  int bucket;
+  int tp_index;
+  int n_treepieces;
+  std::vector<Range> ranges;
+
+  static int commonLevels(Key a, Key b) {
+    Key x = a ^ b;
+    if (x == Key(0)) return BITS_PER_DIM;
+    int p = Utility::mssb64_pos(x);
+    return (int(KEY_BITS) - 2 - p) / LOG_BRANCH_FACTOR;
+  }
+
+  Key keyAt(int index, int depth) const {
+    return particles[index].key >> (KEY_BITS - 1 - LOG_BRANCH_FACTOR * depth);
+  }
+
+  void scan() {
+    std::vector<Open> stack;
+    stack.push_back({-1, 0});
+    ranges.reserve(BITS_PER_DIM * BRANCH_FACTOR);
+    for (int i = 1; i <= n; i++) {
+      ranges.push_back({i - 1, i, BITS_PER_DIM, nullptr});
+      int depth = (i < n) ? commonLevels(particles[i-1].key, particles[i].key) : -1;
+      int start = i - 1;
+      while (depth < stack.back().depth) {
+        Open top = stack.back();
+        stack.pop_back();
+        close(top);
+        start = top.start;
+      }
+      if (depth > stack.back().depth) stack.push_back({depth, start});
+    }
+  }
+
+  // merge the finished children of a range into one, creating its node
+  // if it is too large for a bucket
+  void close(const Open& open) {
+    int first = ranges.size() - 1;
+    while (first > 0 && ranges[first - 1].start >= open.start) first--;
+    int end = ranges.back().end;
+    Node<Data>* node = nullptr;
+    if (end - open.start > bucket && open.depth < BITS_PER_DIM) {
+      if (open.start == 0 && end == n && open.depth == root->depth) node = root;
+      else node = newNode(open.start, end, open.depth);
+      node->type = Node<Data>::Internal;
+      node->n_children = BRANCH_FACTOR;
+      int cursor = open.start;
+      int digit = 0;
+      for (int r = first; r < ranges.size(); r++) {
+        int child_digit = keyAt(ranges[r].start, open.depth + 1) % BRANCH_FACTOR;
+        for (; digit < child_digit; digit++) addEmptyLeaf(node, digit, cursor);
+        node->children[digit].store(attach(ranges[r], open.depth + 1, node));
+        cursor = ranges[r].end;
+        digit++;
+      }
+      for (; digit < BRANCH_FACTOR; digit++) addEmptyLeaf(node, digit, cursor);
+    }
+    ranges.resize(first);
+    ranges.push_back({open.start, end, open.depth, node});
+  }
+
+  // node at the given depth covering a finished range
+  Node<Data>* attach(Range& range, int depth, Node<Data>* parent) {
+    Node<Data>* node;
+    if (range.node && range.depth == depth) {
+      node = range.node;
+    }
+    else {
+      node = newNode(range.start, range.end, depth);
+      if (range.end - range.start <= bucket || depth >= BITS_PER_DIM) makeLeaf(node);
+      else makeChain(node, range);
+    }
+    node->parent = parent;
+    return node;
+  }
+
+  // all particles of the range share the next digit below node
+  void makeChain(Node<Data>* node, Range& range) {
+    node->type = Node<Data>::Internal;
+    node->n_children = BRANCH_FACTOR;
+    int child_digit = keyAt(range.start, node->depth + 1) % BRANCH_FACTOR;
+    for (int digit = 0; digit < BRANCH_FACTOR; digit++) {
+      if (digit == child_digit) node->children[digit].store(attach(range, node->depth + 1, node));
+      else addEmptyLeaf(node, digit, (digit < child_digit) ? range.start : range.end);
+    }
+  }
+
+  Node<Data>* newNode(int start, int end, int depth) {
+    return new Node<Data>(keyAt(start, depth), depth, end - start, particles + start, 0, n_treepieces - 1, nullptr, tp_index);
+  }
+
+  void makeLeaf(Node<Data>* node) {
+    node->type = (node->n_particles == 0) ? Node<Data>::EmptyLeaf : Node<Data>::Leaf;
+  }
+
+  void addEmptyLeaf(Node<Data>* parent, int digit, int index) {
+    Node<Data>* leaf = new Node<Data>((parent->key << LOG_BRANCH_FACTOR) + digit, parent->depth + 1, 0, particles + index, 0, n_treepieces - 1, parent, tp_index);
+    leaf->type = Node<Data>::EmptyLeaf;
+    parent->children[digit].store(leaf);
+  }
+
+  void collectLeaves(std::vector<Node<Data>*>& leaf_list, std::vector<Node<Data>*>& empty_leaf_list) {
+    std::vector<Node<Data>*> stack;
+    stack.push_back(root);
+    while (stack.size()) {
+      Node<Data>* node = stack.back();
+      stack.pop_back();
+      if (node->type == Node<Data>::Leaf) leaf_list.push_back(node);
+      else if (node->type == Node<Data>::EmptyLeaf) empty_leaf_list.push_back(node);
+      else {
+        for (int i = node->n_children - 1; i >= 0; i--) stack.push_back(node->children[i].load());
+      }
+    }
+  }
+};
+
+#endif // SIMPLE_TREEBUILDER_H_
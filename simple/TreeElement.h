@@ -5,6 +5,9 @@
 #include "templates.h"
 #include "Node.h"
 #include "CacheManager.h"
+#include <vector>
+
+extern double top_tolerance;
 
 template<typename Data>
 class CProxy_TreePiece;
@@ -15,64 +18,80 @@ class CProxy_CacheManager;
 template <typename Data>
 class TreeElement : public CBase_TreeElement<Data> {
 private:
-  Data data;
-  int wait_count;
-  int tp_index;
-  CProxy_TreePiece<Data> tp_proxy;
+  Data data; // last value published
+  std::vector<Data> child_data; // last changed value of each child
+  bool published;
+  bool changed; // some child changed this round
+  int wait_count; // children yet to report this round
+  CProxy_TreePiece<Data> tp_proxy; // the root tells TreePiece 0 when the top tree is stored
   CProxy_CacheManager<Data> cache_manager;
-  CProxy_Driver<Data> driver;
 public:
   TreeElement();
   void reset();
-  void recvProxies(TPHolder<Data>, int, CProxy_CacheManager<Data>, DPHolder<Data>);
-  void recvData (Data, bool);
-  void requestData(int);
+  void recvProxies(TPHolder<Data>, CProxy_CacheManager<Data>);
+  void recvData (Data, int, bool);
+  void storeDone();
+  void reportUp(bool);
   void print() {
-    CkPrintf("[TE %d] on PE %d from tp_index %d\n", this->thisIndex, CkMyPe(), tp_index);
+    CkPrintf("[TE %d] on PE %d\n", this->thisIndex, CkMyPe());
   }
 };
 
 template <typename Data>
-void TreeElement<Data>::recvProxies(TPHolder<Data> tp_holderi, int tp_indexi,
-    CProxy_CacheManager<Data> cache_manageri, DPHolder<Data> dp_holder) {
+void TreeElement<Data>::recvProxies(TPHolder<Data> tp_holderi, CProxy_CacheManager<Data> cache_manageri) {
   tp_proxy = tp_holderi.tp_proxy;
-  tp_index = tp_indexi;
   cache_manager = cache_manageri;
-  wait_count = 8;
-  driver = dp_holder.d_proxy;
-  data = Data();
+  reset();
 }
 
 template <typename Data>
-TreeElement<Data>::TreeElement() : data(Data()) {}
+TreeElement<Data>::TreeElement() : data(Data()), published(false), changed(false), wait_count(BRANCH_FACTOR) {}
 
 template <typename Data>
 void TreeElement<Data>::reset() {
   data = Data();
-  wait_count = 8;
+  child_data.assign(BRANCH_FACTOR, Data());
+  published = false;
+  changed = false;
+  wait_count = BRANCH_FACTOR;
 }
 
 template <typename Data>
-void TreeElement<Data>::requestData(int cm_index) {
-  if (tp_index >= 0) tp_proxy[tp_index].requestNodes(this->thisIndex, cm_index);
-  else cache_manager[cm_index].restoreData(std::make_pair(this->thisIndex, data));
+void TreeElement<Data>::recvData (Data datai, int child, bool child_changed) {
+  // every child reports once per build, so a round ends when all of them
+  // have; only the ancestors of changed children are recomputed and stored
+  if (child_changed) {
+    child_data[child] = datai;
+    changed = true;
+  }
+  if (--wait_count > 0) return;
+  wait_count = BRANCH_FACTOR;
+  if (changed) {
+    changed = false;
+    Data sum;
+    for (auto& cd : child_data) sum += cd;
+    if (!published || data.differs(sum, top_tolerance)) {
+      data = sum;
+      published = true;
+      // report up only once the home has stored the value, so the root's
+      // report means the whole top tree is in place
+      cache_manager[CacheManager<Data>::homeOf(this->thisIndex)].storeTop(std::make_pair(Key(this->thisIndex), data),
+          CkCallback(CkIndex_TreeElement<Data>::storeDone(), this->thisProxy[this->thisIndex]));
+      return;
+    }
+  }
+  reportUp(false);
 }
 
 template <typename Data>
-void TreeElement<Data>::recvData (Data datai, bool from_TP) {
-  if (wait_count == 0) reset();
-  data += datai;
-  wait_count--;
-  if (wait_count == 0) {
-    driver.recvTE(std::make_pair(this->thisIndex, data));
-    if (this->thisIndex == 1) {
-      //CkPrintf("Total COM: %f %f %f\n", data.getCentroid().x, data.getCentroid().y, data.getCentroid().z);
-      //cache_manager.restoreData(std::make_pair(1, data));
-    }
-    else {
-      this->thisProxy[this->thisIndex >> 3].recvData(data, false);
-    }
-  }
+void TreeElement<Data>::storeDone() {
+  reportUp(true);
+}
+
+template <typename Data>
+void TreeElement<Data>::reportUp(bool stored) {
+  if (this->thisIndex == 1) tp_proxy[0].topPublished();
+  else this->thisProxy[this->thisIndex >> LOG_BRANCH_FACTOR].recvData(data, this->thisIndex % BRANCH_FACTOR, stored);
 }
 
 #endif // SIMPLE_TREEELEMENT_H_
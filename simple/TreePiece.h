@@ -6,6 +6,9 @@
 #include "templates.h"
 #include "ParticleMsg.h"
 #include "Node.h"
+#include "FlatTree.h"
+#include "NodeDirectory.h"
+#include "TreeBuilder.h"
 #include "Utility.h"
 #include "Reader.h"
 #include "CacheManager.h"
@@ -13,14 +16,19 @@
 #include "Traverser.h"
 #include "Driver.h"
 #include "OrientedBox.h"
+#if PARALLEL_BUILD
+#include "CkLoopAPI.h"
+#endif
 
 #include <queue>
 #include <set>
 #include <stack>
+#include <unordered_map>
 #include <queue>
 #include <vector>
 #include <fstream>
 #include <sstream>
+#include <cstdio>
 #include <cstring>
 #include <atomic>
 #include <mutex>
@@ -30,12 +38,28 @@ extern CProxy_Reader readers;
 extern int max_particles_per_leaf;
 extern int decomp_type;
 extern int tree_type;
+extern int leaf_criterion;
+extern double leaf_param;
+extern double top_tolerance;
 extern CProxy_Main mainProxy;
 
+// particles handed out again by TreePiece::refitDirty, leaf by leaf in key order
+template <typename Data>
+struct RefitState {
+  std::vector<Particle> fresh; // the new particle array, reserved so pointers into it stay valid
+  std::vector<Particle> movers; // key sorted particles that left their leaf or arrived
+  int next_mover = 0;
+  std::unordered_map<Node<Data>*, int> leaf_index; // position in the old leaves
+  std::vector<int> stay_start, stay_count; // by old leaf, into particles
+  std::vector<bool> moved;
+  std::vector<Node<Data>*> leaves, empty_leaves;
+};
+
 template <typename Data>
 class TreePiece : public CBase_TreePiece<Data> {
 public:
   std::vector<Particle> particles, incoming_particles;
+  std::vector<Vector3D<Real>> forces; // indexed like particles
   std::vector<Node<Data>*> leaves;
   std::vector<Node<Data>*> empty_leaves;
   int n_total_particles;
@@ -45,35 +69,87 @@ public:
   Key tp_key; // should be a prefix of all particle keys underneath this node
   Node<Data>* root;
   Node<Data>* root_from_tp_key;
+  FlatTree<Data> flat_tree;
+  NodeDirectory<Data> directory; // key to node for the local subtree
   Traverser<Data>* traverser;
+  CkCallback traversal_cb; // contributed to once the traverser is done
+  bool traversal_done;
   std::vector<std::pair<Node<Data>*, int>> local_travs;
   CProxy_TreeElement<Data> global_data;
   CProxy_CacheManager<Data> cache_manager;
   CacheManager<Data>* cache_local;
   CProxy_Resumer<Data> resumer;
   std::vector<std::vector<Node<Data>*>> interactions;
+  std::vector<double> leaf_costs; // measured interaction cost per leaf
+  std::vector<double> cost_prefix; // estimated cost, prefix summed over particles
+  bool costs_estimated = false; // by a refit that fell back to build, whose old leaves are gone
+  double leaf_cost_target;
+  Data sent_root_data; // root data last sent up to the TreeElements
+  bool root_sent;
   bool cache_init;
+  CkCallback build_cb; // contributed to once the local tree and, on TP 0, the top tree are done
+  bool local_built, top_published;
+  CkCallback perturb_cb; // contributed to once every migrating particle has arrived
+  int n_migrated; // particles received since they were last consumed
+  // left by a migrating perturb for the next refit: how many particles
+  // each leaf kept, stored leaf after leaf in particles, and whether any
+  // of them moved
+  std::vector<int> leaf_kept;
+  std::vector<bool> leaf_moved;
+  int n_expected_migrants; // from the reduced send counts, -1 until known
   // debug
   std::vector<Particle> flushed_particles;
 
-  TreePiece(const CkCallback&, int, int, TEHolder<Data>,
-    CProxy_Resumer<Data>, CProxy_CacheManager<Data>, DPHolder<Data>);
+  TreePiece(CProxy_Resumer<Data>, CProxy_CacheManager<Data>);
+  void reset(const CkCallback&, int, int, TEHolder<Data>);
   void receive(ParticleMsg*);
   void check(const CkCallback&);
   void triggerRequest();
-  void build(bool to_search = true);
-  bool recursiveBuild(Node<Data>*, bool);
+  ~TreePiece();
+  void build(bool, const CkCallback&);
+  void buildLocalTree(bool to_search = true);
+  void refit(const CkCallback&);
+  void finishBuild();
+  void topPublished();
+  void checkBuildDone();
+  bool refitLocalTree();
+  bool refitDirty();
+  int refitDirtyNode(Node<Data>*, RefitState<Data>&);
+  void connectLocalTree(bool);
+  void sendRoot();
+  std::string indexFile(const std::string&);
+  void saveIndex(std::string, const CkCallback&);
+  void loadIndex(std::string, const CkCallback&);
+  bool refitNode(Node<Data>*, Particle*, int);
+  void freeLocalTree();
+  void indexLocalTree();
+  void sendTopSummary();
+  void sendOccupancy();
+  void sendVersion();
+  bool recursiveBuild(Node<Data>*, bool, std::vector<Node<Data>*>&, std::vector<Node<Data>*>&, bool fan_out = true);
+  void estimateCosts();
+  bool isLight(Node<Data>*);
+  void addCost(int bucket, int n_sources) {
+    leaf_costs[bucket] += n_sources * leaves[bucket]->n_particles;
+  }
   void upOnly(bool);
   inline void initCache();
-  void requestNodes(Key, int);
-  template<typename Visitor> void startDown();
-  template<typename Visitor> void startUpAndDown();
-  template<typename Visitor> void startDual(Key*, int);
+  void requestNodes(NodeRequest*, int);
+  Vector3D<Real>* forcesOf(Node<Data>*);
+  void resetForces();
+  template<typename Visitor> void startDown(const CkCallback&);
+  template<typename Visitor> void startUpAndDown(const CkCallback&);
+  template<typename Visitor> void startDual(Key*, int, const CkCallback&);
+  void checkTraversalDone();
   void goDown(Key); 
   void processLocal(const CkCallback&);
   void interact(const CkCallback&);
   void print(Node<Data>*);
-  void perturb (Real timestep, bool);
+  template<typename Visitor> void benchLocalWalk(const CkCallback&);
+  void benchBuild(const CkCallback&);
+  void perturb (Real timestep, bool, const CkCallback&);
+  void recvMigrationCounts(CkReductionMsg*);
+  void checkMigrationDone();
   void flush(CProxy_Reader);
 
   // debug
@@ -93,9 +169,51 @@ public:
     this->contribute(sizeof(bool), &result, CkReduction::logical_and_bool, cb);
   }
 };
+
+#if PARALLEL_BUILD
+// parameters shared by the CkLoop helpers used in TreePiece::build
 template <typename Data>
-TreePiece<Data>::TreePiece(const CkCallback& cb, int n_total_particles_, int n_treepieces_, TEHolder<Data> global_datai, CProxy_Resumer<Data> resumeri, CProxy_CacheManager<Data> cache_manageri, DPHolder<Data> dp_holder) : n_total_particles(n_total_particles_), n_treepieces(n_treepieces_), particle_index(0) {
-  global_data = global_datai.te_proxy;
+struct BuildTask {
+  TreePiece<Data>* tp;
+  Node<Data>* node;
+  Particle* particles;
+  int n_particles;
+  int n_chunks;
+  std::vector<Node<Data>*> leaves[BRANCH_FACTOR];
+  std::vector<Node<Data>*> empty_leaves[BRANCH_FACTOR];
+};
+
+template <typename Data>
+void sortChunks(int first, int last, void* result, int param_num, void* param) {
+  BuildTask<Data>* task = (BuildTask<Data>*)param;
+  for (int i = first; i <= last; i++) {
+    int start = (long)task->n_particles * i / task->n_chunks;
+    int end = (long)task->n_particles * (i + 1) / task->n_chunks;
+    std::sort(task->particles + start, task->particles + end);
+  }
+}
+
+template <typename Data>
+void buildChildren(int first, int last, void* result, int param_num, void* param) {
+  BuildTask<Data>* task = (BuildTask<Data>*)param;
+  for (int i = first; i <= last; i++) {
+    // already inside a CkLoop chunk, which cannot start another
+    task->tp->recursiveBuild(task->node->children[i].load(), true, task->leaves[i], task->empty_leaves[i], false);
+  }
+}
+
+template <typename Data>
+void computeLeafData(int first, int last, void* result, int param_num, void* param) {
+  BuildTask<Data>* task = (BuildTask<Data>*)param;
+  for (int i = first; i <= last; i++) {
+    Node<Data>* leaf = task->tp->leaves[i];
+    leaf->data = Data(leaf->particles, leaf->n_particles);
+  }
+}
+#endif
+template <typename Data>
+TreePiece<Data>::TreePiece(CProxy_Resumer<Data> resumeri, CProxy_CacheManager<Data> cache_manageri) : n_total_particles(0), n_treepieces(0), particle_index(0),
+    local_built(false), top_published(false), n_migrated(0), n_expected_migrants(-1) {
   resumer = resumeri;
   resumer.ckLocalBranch()->tp_proxy = this->thisProxy;
   cache_manager = cache_manageri;
@@ -103,6 +221,31 @@ TreePiece<Data>::TreePiece(const CkCallback& cb, int n_total_particles_, int n_t
   resumer.ckLocalBranch()->cache_local = cache_local;
   cache_local->resumer = resumer;
   cache_init = false;
+  root_sent = false;
+  root_from_tp_key = nullptr;
+}
+template <typename Data>
+void TreePiece<Data>::reset(const CkCallback& cb, int n_total_particles_, int n_treepieces_, TEHolder<Data> global_datai) {
+  // TreePieces persist across decompositions; take the new key range and
+  // drop everything left from the old one
+  n_total_particles = n_total_particles_;
+  n_treepieces = n_treepieces_;
+  global_data = global_datai.te_proxy;
+  freeLocalTree();
+  particles.resize(0);
+  incoming_particles.resize(0);
+  forces.resize(0);
+  leaves.resize(0);
+  empty_leaves.resize(0);
+  local_travs.resize(0);
+  particle_index = 0;
+  cache_init = false;
+  root_sent = false;
+  local_built = top_published = false;
+  n_migrated = 0;
+  n_expected_migrants = -1;
+  leaf_kept.resize(0);
+  leaf_moved.resize(0);
 
   if (decomp_type == OCT_DECOMP) {
     // OCT decomposition
@@ -116,15 +259,32 @@ TreePiece<Data>::TreePiece(const CkCallback& cb, int n_total_particles_, int n_t
       n_expected++;
       // TODO tp_key needs to be found in local tree build
   }
-  global_data[tp_key].recvProxies(TPHolder<Data>(this->thisProxy), this->thisIndex, cache_manager, dp_holder);
+#if !COLLECTIVE_TOP
+  // TreeElements stand only above TreePieces, each created by the
+  // TreePiece leftmost under it
   Key temp = tp_key;
   while (temp > 0 && temp % BRANCH_FACTOR == 0) {
     temp /= BRANCH_FACTOR;
-    //CkPrintf("temp = %d\n", temp);
-    global_data[temp].recvProxies(TPHolder<Data>(this->thisProxy), -1, cache_manager, dp_holder);
+    global_data[temp].recvProxies(TPHolder<Data>(this->thisProxy), cache_manager);
  }
+#endif
   this->contribute(cb);
-  root_from_tp_key = nullptr;
+}
+template <typename Data>
+TreePiece<Data>::~TreePiece() {
+  freeLocalTree();
+}
+template <typename Data>
+void TreePiece<Data>::freeLocalTree() {
+  // the local subtree is owned by the TreePiece; CacheManager::destroy
+  // detaches it from the cached tree above before freeing that
+  if (root_from_tp_key != nullptr) {
+    root_from_tp_key->triggerFree();
+    delete root_from_tp_key;
+    root_from_tp_key = nullptr;
+  }
+  flat_tree.clear();
+  directory.reset(0);
 }
 template <typename Data>
 void TreePiece<Data>::receive(ParticleMsg* msg) {
@@ -133,7 +293,9 @@ void TreePiece<Data>::receive(ParticleMsg* msg) {
   incoming_particles.resize(initial_size + msg->n_particles);
   std::memcpy(&incoming_particles[initial_size], msg->particles, msg->n_particles * sizeof(Particle));
   particle_index += msg->n_particles;
+  n_migrated += msg->n_particles;
   delete msg;
+  if (n_expected_migrants >= 0) checkMigrationDone();
 }
 template <typename Data>
 void TreePiece<Data>::check(const CkCallback& cb) {
@@ -148,13 +310,43 @@ void TreePiece<Data>::triggerRequest() {
   readers.ckLocalBranch()->request(this->thisProxy, this->thisIndex, n_expected);
 }
 template <typename Data>
-void TreePiece<Data>::build(bool to_search) {
+void TreePiece<Data>::build(bool to_search, const CkCallback& cb) {
+  build_cb = cb;
+  buildLocalTree(to_search);
+  finishBuild();
+}
+template <typename Data>
+void TreePiece<Data>::buildLocalTree(bool to_search) {
   int n_particles_saved = particles.size(), n_particles_received = incoming_particles.size();
   particles.resize(n_particles_saved + n_particles_received);
   std::copy(incoming_particles.begin(), incoming_particles.end(), particles.begin() + n_particles_saved);
   incoming_particles.resize(0);
+  n_migrated = 0;
+  leaf_kept.resize(0);
+  leaf_moved.resize(0);
   // sort particles received from readers
+#if PARALLEL_BUILD
+  if (particles.size() > PARALLEL_BUILD_THRESHOLD && CkMyNodeSize() > 1) {
+    // sort chunks concurrently, then merge them pairwise
+    BuildTask<Data> task;
+    task.particles = particles.data();
+    task.n_particles = particles.size();
+    task.n_chunks = CkMyNodeSize();
+    CkLoop_Parallelize(sortChunks<Data>, 1, &task, task.n_chunks, 0, task.n_chunks - 1);
+    for (int width = 1; width < task.n_chunks; width *= 2) {
+      for (int i = 0; i + width < task.n_chunks; i += 2 * width) {
+        int start = (long)task.n_particles * i / task.n_chunks;
+        int mid = (long)task.n_particles * (i + width) / task.n_chunks;
+        int end = (long)task.n_particles * std::min(i + 2 * width, task.n_chunks) / task.n_chunks;
+        std::inplace_merge(particles.begin() + start, particles.begin() + mid, particles.begin() + end);
+      }
+    }
+  }
+  else
+#endif
   std::sort(particles.begin(), particles.end());
+  if (!costs_estimated) estimateCosts();
+  costs_estimated = false;
   // create global root and recurse
 #if DEBUG
   CkPrintf("[TP %d] key: 0x%" PRIx64 " particles: %d\n", this->thisIndex, tp_key, particles.size());
@@ -162,15 +354,403 @@ void TreePiece<Data>::build(bool to_search) {
   leaves.resize(0);
   empty_leaves.resize(0);
   local_travs.resize(0);
+  freeLocalTree();
   root = new Node<Data>(1, 0, particles.size(), &particles[0], 0, n_treepieces - 1, nullptr);
-  recursiveBuild(root, false);
+  recursiveBuild(root, false, leaves, empty_leaves);
   interactions = std::vector<std::vector<Node<Data>*>> (leaves.size());
+  leaf_costs.assign(leaves.size(), 0.0);
+  resetForces();
   cache_init = false;
   upOnly(to_search);
   initCache();
+  indexLocalTree();
+  sendOccupancy();
+  sendVersion();
+#if COLLECTIVE_TOP
+  sendTopSummary();
+#endif
+#if FLATTREE
+  flat_tree.build(root_from_tp_key);
+#endif
 }
 template <typename Data>
-bool TreePiece<Data>::recursiveBuild(Node<Data>* node, bool saw_tp_key) {
+void TreePiece<Data>::refit(const CkCallback& cb) {
+  build_cb = cb;
+  if (root_from_tp_key == nullptr) {
+    buildLocalTree(true);
+    finishBuild();
+    return;
+  }
+  // after a migrating perturb only what changed is redone; cost criteria
+  // are estimated per particle over the whole array, so they refit fully
+  if (leaf_criterion != COST_LEAF && leaves.size() && leaf_kept.size() == leaves.size()) {
+    if (!refitDirty()) {
+#if DEBUG
+      CkPrintf("[TP %d] refit failed, rebuilding local tree\n", this->thisIndex);
+#endif
+      buildLocalTree(true);
+    }
+    finishBuild();
+    return;
+  }
+  leaf_kept.resize(0);
+  leaf_moved.resize(0);
+  int n_particles_saved = particles.size(), n_particles_received = incoming_particles.size();
+  particles.resize(n_particles_saved + n_particles_received);
+  std::copy(incoming_particles.begin(), incoming_particles.end(), particles.begin() + n_particles_saved);
+  incoming_particles.resize(0);
+  n_migrated = 0;
+
+  // particles have moved since keys were assigned, so regenerate them
+  const BoundingBox& universe = readers.ckLocalBranch()->universe;
+  Key tp_first = Utility::removeLeadingZeros(tp_key);
+  Key tp_last = Utility::getLastParticleLevelKey(tp_key, Utility::getDepthFromKey(tp_key));
+  bool keys_inside = true;
+  for (auto& particle : particles) {
+    particle.key = Utility::generateKey(particle.position, universe.box);
+    particle.key |= (Key)1 << (KEY_BITS-1);
+    if (particle.key < tp_first || particle.key > tp_last) keys_inside = false;
+  }
+  std::sort(particles.begin(), particles.end());
+
+  // keep the existing structure, only redistribute particles among its
+  // leaves; fall back to a local rebuild if a leaf overflows
+  if (!keys_inside || !refitLocalTree()) {
+#if DEBUG
+    CkPrintf("[TP %d] refit failed, rebuilding local tree\n", this->thisIndex);
+#endif
+    buildLocalTree(true);
+  }
+  finishBuild();
+}
+template <typename Data>
+void TreePiece<Data>::finishBuild() {
+  local_built = true;
+  checkBuildDone();
+}
+template <typename Data>
+void TreePiece<Data>::topPublished() {
+  // from the root TreeElement, once every changed top node is stored
+  top_published = true;
+  checkBuildDone();
+}
+template <typename Data>
+void TreePiece<Data>::checkBuildDone() {
+  if (!local_built) return;
+#if !COLLECTIVE_TOP
+  if (this->thisIndex == 0 && !top_published) return;
+#endif
+  local_built = top_published = false;
+  this->contribute(build_cb);
+}
+template <typename Data>
+bool TreePiece<Data>::refitLocalTree() {
+  // leaves are checked with the build criterion, which may need costs
+  estimateCosts();
+  leaves.resize(0);
+  empty_leaves.resize(0);
+  local_travs.resize(0);
+  if (!refitNode(root_from_tp_key, particles.data(), particles.size())) {
+    costs_estimated = true;
+    return false;
+  }
+  connectLocalTree(true);
+  return true;
+}
+template <typename Data>
+bool TreePiece<Data>::refitDirty() {
+  // perturb left the particles grouped by leaf, so only the ones that left
+  // their leaf or arrived from other TreePieces are sorted and handed out,
+  // and Data is only recomputed above leaves that changed
+  const BoundingBox& universe = readers.ckLocalBranch()->universe;
+  Key tp_first = Utility::removeLeadingZeros(tp_key);
+  Key tp_last = Utility::getLastParticleLevelKey(tp_key, Utility::getDepthFromKey(tp_key));
+  RefitState<Data> state;
+  state.movers.swap(incoming_particles);
+  n_migrated = 0;
+  for (auto& particle : state.movers) {
+    particle.key = Utility::generateKey(particle.position, universe.box);
+    particle.key |= (Key)1 << (KEY_BITS-1);
+  }
+  state.stay_start.resize(leaves.size());
+  state.stay_count.resize(leaves.size());
+  int offset = 0;
+  for (int l = 0; l < leaves.size(); l++) {
+    state.leaf_index[leaves[l]] = l;
+    int kept = offset;
+    if (leaf_moved[l]) {
+      Key leaf_first = Utility::removeLeadingZeros(leaves[l]->key);
+      Key leaf_last = Utility::getLastParticleLevelKey(leaves[l]->key, Utility::getDepthFromKey(leaves[l]->key));
+      for (int i = offset; i < offset + leaf_kept[l]; i++) {
+        Particle& particle = particles[i];
+        particle.key = Utility::generateKey(particle.position, universe.box);
+        particle.key |= (Key)1 << (KEY_BITS-1);
+        if (particle.key >= leaf_first && particle.key <= leaf_last) particles[kept++] = particle;
+        else state.movers.push_back(particle);
+      }
+    }
+    else kept += leaf_kept[l];
+    state.stay_start[l] = offset;
+    state.stay_count[l] = kept - offset;
+    offset += leaf_kept[l];
+  }
+  state.moved.swap(leaf_moved);
+  leaf_kept.resize(0);
+  std::sort(state.movers.begin(), state.movers.end());
+  bool keys_inside = !state.movers.size() || (state.movers.front().key >= tp_first && state.movers.back().key <= tp_last);
+  int n_stays = 0;
+  for (int count : state.stay_count) n_stays += count;
+  state.fresh.reserve(n_stays + state.movers.size());
+  if (!keys_inside || refitDirtyNode(root_from_tp_key, state) < 0) {
+    // hand every particle to a rebuild
+    std::vector<Particle> all;
+    all.reserve(n_stays + state.movers.size());
+    for (int l = 0; l < leaves.size(); l++) {
+      all.insert(all.end(), particles.begin() + state.stay_start[l], particles.begin() + state.stay_start[l] + state.stay_count[l]);
+    }
+    all.insert(all.end(), state.movers.begin(), state.movers.end());
+    particles.swap(all);
+    return false;
+  }
+  particles.swap(state.fresh);
+  leaves.swap(state.leaves);
+  empty_leaves.swap(state.empty_leaves);
+  local_travs.resize(0);
+  connectLocalTree(false);
+  return true;
+}
+template <typename Data>
+int TreePiece<Data>::refitDirtyNode(Node<Data>* node, RefitState<Data>& state) {
+  // -1 if a leaf overflows, otherwise whether the node's Data changed
+  Particle* first = state.fresh.data() + state.fresh.size();
+  bool dirty = false;
+  node->wait_count = BRANCH_FACTOR;
+  node->requested.store(false);
+  if (node->type == Node<Data>::Leaf || node->type == Node<Data>::EmptyLeaf) {
+    if (node->type == Node<Data>::Leaf) {
+      int l = state.leaf_index[node];
+      auto stays = particles.begin() + state.stay_start[l];
+      state.fresh.insert(state.fresh.end(), stays, stays + state.stay_count[l]);
+      dirty = state.moved[l] || state.stay_count[l] != node->n_particles;
+    }
+    Key last = Utility::getLastParticleLevelKey(node->key, Utility::getDepthFromKey(node->key));
+    while (state.next_mover < state.movers.size() && state.movers[state.next_mover].key <= last) {
+      state.fresh.push_back(state.movers[state.next_mover++]);
+      dirty = true;
+    }
+    int n_particles = state.fresh.size() - (first - state.fresh.data());
+    node->particles = first;
+    node->n_particles = n_particles;
+    if (n_particles == 0) state.empty_leaves.push_back(node);
+    else state.leaves.push_back(node);
+    if (!dirty) return 0;
+    std::sort(first, first + n_particles);
+    if (!isLight(node)) return -1;
+    if (n_particles == 0) {
+      node->type = Node<Data>::EmptyLeaf;
+      node->data = Data();
+    }
+    else {
+      node->type = Node<Data>::Leaf;
+      node->data = Data(first, n_particles);
+    }
+    return 1;
+  }
+  int n_particles = 0;
+  for (int i = 0; i < node->n_children; i++) {
+    Node<Data>* child = node->children[i].load();
+    int result = refitDirtyNode(child, state);
+    if (result < 0) return -1;
+    if (result) dirty = true;
+    n_particles += child->n_particles;
+  }
+  node->particles = first;
+  node->n_particles = n_particles;
+  if (dirty) {
+    node->data = Data();
+    for (int i = 0; i < node->n_children; i++) node->data += node->children[i].load()->data;
+  }
+  return dirty;
+}
+template <typename Data>
+void TreePiece<Data>::connectLocalTree(bool compute_data) {
+  // the refitted subtree goes back into the cache and out to the
+  // TreeElements and CacheManagers, as after a build
+  root_from_tp_key->parent = nullptr;
+  interactions = std::vector<std::vector<Node<Data>*>> (leaves.size());
+  leaf_costs.assign(leaves.size(), 0.0);
+  resetForces();
+  cache_init = true;
+  cache_local->connect(root_from_tp_key, false);
+  if (compute_data) upOnly(true);
+  else sendRoot();
+  indexLocalTree();
+  sendOccupancy();
+  sendVersion();
+#if COLLECTIVE_TOP
+  sendTopSummary();
+#endif
+#if FLATTREE
+  flat_tree.build(root_from_tp_key);
+#endif
+}
+template <typename Data>
+std::string TreePiece<Data>::indexFile(const std::string& dir) {
+  return dir + "/tp_" + std::to_string(this->thisIndex);
+}
+template <typename Data>
+void TreePiece<Data>::saveIndex(std::string dir, const CkCallback& cb) {
+  // particles in key order and the shape of the local subtree in preorder,
+  // one flag per node telling whether it has children
+  std::vector<char> shape;
+  std::vector<Node<Data>*> stack;
+  if (root_from_tp_key != nullptr) stack.push_back(root_from_tp_key);
+  while (stack.size()) {
+    Node<Data>* node = stack.back();
+    stack.pop_back();
+    shape.push_back(node->n_children > 0);
+    for (int i = node->n_children - 1; i >= 0; i--) stack.push_back(node->children[i].load());
+  }
+  FILE* fp = fopen(indexFile(dir).c_str(), "wb");
+  if (fp == nullptr) CkAbort("TreePiece::saveIndex: cannot open index file");
+  PUP::toDisk p (fp);
+  p | tp_key;
+  p | particles;
+  p | shape;
+  fclose(fp);
+  this->contribute(cb);
+}
+template <typename Data>
+void TreePiece<Data>::loadIndex(std::string dir, const CkCallback& cb) {
+  std::vector<char> shape;
+  Key saved_key;
+  FILE* fp = fopen(indexFile(dir).c_str(), "rb");
+  if (fp == nullptr) CkAbort("TreePiece::loadIndex: cannot open index file");
+  PUP::fromDisk p (fp);
+  p | saved_key;
+  p | particles;
+  p | shape;
+  fclose(fp);
+  if (saved_key != tp_key) CkAbort("TreePiece::loadIndex: index does not match the decomposition");
+
+  // recreate the saved nodes empty, refitting them hands out the particles
+  // and computes their data
+  root_from_tp_key = new Node<Data>(tp_key, Utility::getDepthFromKey(tp_key), 0, particles.data(), 0, n_treepieces - 1, nullptr, this->thisIndex);
+  std::vector<Node<Data>*> stack (1, root_from_tp_key);
+  int next = 0;
+  while (stack.size() && next < shape.size()) {
+    Node<Data>* node = stack.back();
+    stack.pop_back();
+    if (!shape[next++]) {
+      node->type = Node<Data>::Leaf;
+      continue;
+    }
+    node->type = Node<Data>::Internal;
+    node->n_children = BRANCH_FACTOR;
+    for (int i = 0; i < BRANCH_FACTOR; i++) {
+      Node<Data>* child = new Node<Data>((node->key << LOG_BRANCH_FACTOR) + i, node->depth + 1, 0, particles.data(), 0, n_treepieces - 1, node, this->thisIndex);
+      node->children[i].store(child);
+    }
+    for (int i = BRANCH_FACTOR - 1; i >= 0; i--) stack.push_back(node->children[i].load());
+  }
+  // leaves saved under a different leaf size, build from scratch instead
+  build_cb = cb;
+  if (!refitLocalTree()) buildLocalTree(true);
+  finishBuild();
+}
+template <typename Data>
+bool TreePiece<Data>::refitNode(Node<Data>* node, Particle* node_particles, int n_particles) {
+  node->particles = node_particles;
+  node->n_particles = n_particles;
+  node->data = Data();
+  node->wait_count = BRANCH_FACTOR;
+  node->requested.store(false);
+
+  if (node->type == Node<Data>::Leaf || node->type == Node<Data>::EmptyLeaf) {
+    // the leaf must still pass the criterion the tree was built with
+    if (!isLight(node)) return false;
+    if (n_particles == 0) {
+      node->type = Node<Data>::EmptyLeaf;
+      empty_leaves.push_back(node);
+    }
+    else {
+      node->type = Node<Data>::Leaf;
+      leaves.push_back(node);
+    }
+    return true;
+  }
+
+  // same partitioning as recursiveBuild, without allocating nodes
+  Key child_key = node->key << LOG_BRANCH_FACTOR;
+  int start = 0;
+  for (int i = 0; i < node->n_children; i++) {
+    int first_ge_idx = n_particles;
+    if (i < node->n_children - 1) {
+      Key sibling_splitter = Utility::removeLeadingZeros(child_key + 1);
+      first_ge_idx = Utility::binarySearchGE(sibling_splitter, node_particles, start, n_particles);
+    }
+    if (!refitNode(node->children[i].load(), node_particles + start, first_ge_idx - start)) return false;
+    start = first_ge_idx;
+    child_key++;
+  }
+  return true;
+}
+template <typename Data>
+void TreePiece<Data>::estimateCosts() {
+  // spread each old leaf's measured cost evenly over the (key sorted)
+  // particles that now fall in its key range
+  cost_prefix.resize(0);
+  if (leaf_criterion != COST_LEAF || !leaves.size() || leaf_costs.size() != leaves.size()) return;
+  double total_cost = 0.0;
+  int total_particles = 0;
+  for (int l = 0; l < leaves.size(); l++) {
+    total_cost += leaf_costs[l];
+    total_particles += leaves[l]->n_particles;
+  }
+  if (total_cost <= 0.0) return;
+  double mean_cost = total_cost / total_particles;
+  leaf_cost_target = leaf_param * total_cost / leaves.size();
+
+  cost_prefix.resize(particles.size() + 1);
+  cost_prefix[0] = 0.0;
+  int l = 0;
+  for (int i = 0; i < particles.size(); i++) {
+    Key key = particles[i].key;
+    while (l < leaves.size() && key > Utility::getLastParticleLevelKey(leaves[l]->key, leaves[l]->depth)) l++;
+    double cost = mean_cost;
+    if (l < leaves.size() && key >= Utility::removeLeadingZeros(leaves[l]->key)) {
+      cost = leaf_costs[l] / leaves[l]->n_particles;
+    }
+    cost_prefix[i+1] = cost_prefix[i] + cost;
+  }
+}
+template <typename Data>
+bool TreePiece<Data>::isLight(Node<Data>* node) {
+  int n_bucket = ceil(BUCKET_TOLERANCE * max_particles_per_leaf);
+  if (node->n_particles == 0) return true;
+  // keys have no more levels to split on, whatever the criterion
+  if (node->depth >= int(BITS_PER_DIM)) return true;
+  switch (leaf_criterion) {
+    case COST_LEAF:
+      if (cost_prefix.size() == particles.size() + 1) {
+        int start = node->particles - particles.data();
+        double cost = cost_prefix[start + node->n_particles] - cost_prefix[start];
+        return (node->n_particles == 1 || cost <= leaf_cost_target);
+      }
+      break; // nothing measured yet
+    case EXTENT_LEAF: {
+      Real extent = Utility::maxExtent(readers.ckLocalBranch()->universe.box) / Real(Key(1) << node->depth);
+      if (extent <= leaf_param) return true;
+      break;
+    }
+    case DEPTH_LEAF:
+      if (node->depth < leaf_param) return false;
+      break;
+  }
+  return (node->n_particles <= n_bucket);
+}
+template <typename Data>
+bool TreePiece<Data>::recursiveBuild(Node<Data>* node, bool saw_tp_key, std::vector<Node<Data>*>& leaf_list, std::vector<Node<Data>*>& empty_leaf_list, bool fan_out) {
 #if DEBUG
   //CkPrintf("[Level %d] created node 0x%" PRIx64 " with %d particles\n",
     //  node->depth, node->key, node->n_particles);
@@ -183,10 +763,18 @@ bool TreePiece<Data>::recursiveBuild(Node<Data>* node, bool saw_tp_key) {
     if (!saw_tp_key) {
       saw_tp_key = (node->key == tp_key);
       if (saw_tp_key) root_from_tp_key = node;
+#if BOTTOM_UP_BUILD
+      // build the whole local subtree in one scan of the sorted keys
+      if (saw_tp_key && leaf_criterion == COUNT_LEAF) {
+        BottomUpBuilder<Data> builder(node, ceil(BUCKET_TOLERANCE * max_particles_per_leaf), this->thisIndex, n_treepieces);
+        builder.build(leaf_list, empty_leaf_list);
+        return true;
+      }
+#endif
     }
 
 
-    bool is_light = (node->n_particles <= ceil(BUCKET_TOLERANCE * max_particles_per_leaf));
+    bool is_light = isLight(node);
     bool is_prefix = Utility::isPrefix(node->key, tp_key);
     /*
     int owner_start = node->owner_tp_start;
@@ -199,11 +787,11 @@ bool TreePiece<Data>::recursiveBuild(Node<Data>* node, bool saw_tp_key) {
       if (is_light) {
         if (node->n_particles == 0) {
           node->type = Node<Data>::EmptyLeaf;
-          empty_leaves.push_back(node);
+          empty_leaf_list.push_back(node);
         }
         else {
           node->type = Node<Data>::Leaf;
-          leaves.push_back(node);
+          leaf_list.push_back(node);
         }
         return true;
       }
@@ -270,6 +858,13 @@ bool TreePiece<Data>::recursiveBuild(Node<Data>* node, bool saw_tp_key) {
     int start = 0;
     int finish = start + node->n_particles;
     int non_local_children = 0;
+#if PARALLEL_BUILD
+    // below the TP key all children are local, so large octants can be built
+    // concurrently by the other PEs of this node and joined in key order
+    bool build_parallel = fan_out && saw_tp_key && node->n_particles > PARALLEL_BUILD_THRESHOLD && CkMyNodeSize() > 1;
+#else
+    bool build_parallel = false;
+#endif
 
     for (int i = 0; i < node->n_children; i++) {
       Key sibling_splitter = Utility::removeLeadingZeros(child_key + 1);
@@ -309,15 +904,29 @@ bool TreePiece<Data>::recursiveBuild(Node<Data>* node, bool saw_tp_key) {
       node->children[i].store(child);
 
       // recursive tree build
-      bool local = recursiveBuild(child, saw_tp_key);
+      if (!build_parallel) {
+        bool local = recursiveBuild(child, saw_tp_key, leaf_list, empty_leaf_list, fan_out);
 
-      if (!local) {
-        non_local_children++;
+        if (!local) {
+          non_local_children++;
+        }
       }
 
       start = first_ge_idx;
       child_key++;
     }
+#if PARALLEL_BUILD
+    if (build_parallel) {
+      BuildTask<Data> task;
+      task.tp = this;
+      task.node = node;
+      CkLoop_Parallelize(buildChildren<Data>, 1, &task, node->n_children, 0, node->n_children - 1);
+      for (int i = 0; i < node->n_children; i++) {
+        leaf_list.insert(leaf_list.end(), task.leaves[i].begin(), task.leaves[i].end());
+        empty_leaf_list.insert(empty_leaf_list.end(), task.empty_leaves[i].begin(), task.empty_leaves[i].end());
+      }
+    }
+#endif
     if (non_local_children == 0) {
       node->type = Node<Data>::Internal;
     }
@@ -333,6 +942,15 @@ bool TreePiece<Data>::recursiveBuild(Node<Data>* node, bool saw_tp_key) {
 template <typename Data>
 void TreePiece<Data>::upOnly(bool first_time) {
   std::queue<Node<Data>*> going_up;
+#if PARALLEL_BUILD
+  if (leaves.size() && particles.size() > PARALLEL_BUILD_THRESHOLD && CkMyNodeSize() > 1) {
+    BuildTask<Data> task;
+    task.tp = this;
+    CkLoop_Parallelize(computeLeafData<Data>, 1, &task, CkMyNodeSize(), 0, leaves.size() - 1);
+    for (auto leaf : leaves) going_up.push(leaf);
+  }
+  else
+#endif
   for (auto leaf : leaves) {
     leaf->data = Data(leaf->particles, leaf->n_particles);
     going_up.push(leaf);
@@ -342,9 +960,7 @@ void TreePiece<Data>::upOnly(bool first_time) {
   while (going_up.size()) {
     Node<Data>* node = going_up.front();
     going_up.pop();
-    if (node->key == tp_key) {
-      global_data[tp_key >> LOG_BRANCH_FACTOR].recvData(node->data, true);
-    }
+    if (node->key == tp_key) sendRoot();
     else {
       Node<Data>* parent = node->parent;
       parent->data += node->data;
@@ -354,6 +970,21 @@ void TreePiece<Data>::upOnly(bool first_time) {
   }
 }
 template <typename Data>
+void TreePiece<Data>::sendRoot() {
+#if !COLLECTIVE_TOP
+  // TreeElements keep the last value, so only flag changes; every build
+  // still reports so that the TreeElements know when a round is over
+  Data& root_data = root_from_tp_key->data;
+  bool changed = !root_sent || sent_root_data.differs(root_data, top_tolerance);
+  if (tp_key == 1) top_published = true; // no top tree above a single TreePiece
+  else global_data[tp_key >> LOG_BRANCH_FACTOR].recvData(root_data, tp_key % BRANCH_FACTOR, changed);
+  if (changed) {
+    sent_root_data = root_data;
+    root_sent = true;
+  }
+#endif
+}
+template <typename Data>
 void TreePiece<Data>::initCache() {
   if (!cache_init) {
     cache_local->connect(root_from_tp_key, false);
@@ -364,34 +995,135 @@ void TreePiece<Data>::initCache() {
 }
 template <typename Data>
 template <typename Visitor>
-void TreePiece<Data>::startDown() {
+void TreePiece<Data>::startDown(const CkCallback& cb) {
+  traversal_cb = cb;
+  traversal_done = false;
   traverser = new DownTraverser<Data, Visitor>(this);
   goDown(1);
 }
 template <typename Data>
 template <typename Visitor>
-void TreePiece<Data>::startUpAndDown() {
-  if (!leaves.size()) return;
+void TreePiece<Data>::startUpAndDown(const CkCallback& cb) {
+  traversal_cb = cb;
+  traversal_done = false;
+  if (!leaves.size()) {
+    traversal_done = true;
+    this->contribute(cb);
+    return;
+  }
   traverser = new UpnDTraverser<Data, Visitor>(this);
-  for (auto leaf : leaves) goDown(leaf->key);
+  cache_local->beginWalk();
+  for (auto leaf : leaves) traverser->traverse(leaf->key);
+  cache_local->flushRequests();
+  cache_local->endWalk();
+  checkTraversalDone();
 }
 template <typename Data>
 template <typename Visitor>
-void TreePiece<Data>::startDual(Key* keys_ptr, int n) {
+void TreePiece<Data>::startDual(Key* keys_ptr, int n, const CkCallback& cb) {
+  traversal_cb = cb;
+  traversal_done = false;
   std::vector<Key> keys (keys_ptr, keys_ptr + n);
   traverser = new DualTraverser<Data, Visitor>(this, keys);
-  for (auto key : keys) goDown(key);
+  cache_local->beginWalk();
+  for (auto key : keys) traverser->traverse(key);
+  cache_local->flushRequests();
+  cache_local->endWalk();
+  checkTraversalDone();
   // root needs to be the root of the searched tree, not the searching tree
 }
 template <typename Data>
-void TreePiece<Data>::requestNodes(Key key, int cm_index) {
-  Node<Data>* node = root_from_tp_key->findNode(key);
-  if (!node) CkPrintf("null found for key %d on tp %d\n", key, this->thisIndex);
-  cache_local->serviceRequest(node, cm_index);
+void TreePiece<Data>::indexLocalTree() {
+  if (root_from_tp_key == nullptr) return;
+  // every internal node has BRANCH_FACTOR children
+  int n_leaves = leaves.size() + empty_leaves.size();
+  directory.reset(n_leaves + n_leaves / (BRANCH_FACTOR - 1) + 1);
+  directory.insertSubtree(root_from_tp_key);
+}
+template <typename Data>
+void TreePiece<Data>::sendOccupancy() {
+  // counts are taken from the keys the tree was built on, so they stay
+  // consistent with it even when particles have moved since
+  std::vector<int> counts (1 << (LOG_BRANCH_FACTOR * OCCUPANCY_LEVELS), 0);
+  int shift = KEY_BITS - 1 - LOG_BRANCH_FACTOR * OCCUPANCY_LEVELS;
+  for (auto& particle : particles) counts[int(particle.key >> shift) & (counts.size() - 1)]++;
+  this->contribute(counts.size() * sizeof(int), counts.data(), CkReduction::sum_int,
+      CkCallback(CkIndex_CacheManager<Data>::recvOccupancy(NULL), cache_manager));
+}
+template <typename Data>
+void TreePiece<Data>::sendVersion() {
+  // hash of everything a remote copy of the local tree is made of: the
+  // leaves and the particle fields visitors read. Kept remote copies are
+  // checked against the versions of the TreePieces they came from
+  uint64_t version = 14695981039346656037ULL;
+  auto mix = [&version](const void* bytes, size_t n) {
+    for (size_t i = 0; i < n; i++) version = (version ^ ((const unsigned char*)bytes)[i]) * 1099511628211ULL;
+  };
+  for (auto leaf : leaves) mix(&leaf->key, sizeof(Key));
+  for (auto& particle : particles) {
+    mix(&particle.key, sizeof(Key));
+    mix(&particle.mass, sizeof(Real));
+    mix(&particle.density, sizeof(Real));
+    mix(&particle.pressure, sizeof(Real));
+    mix(&particle.position, sizeof(particle.position));
+  }
+  std::pair<int, unsigned long long> indexed_version (this->thisIndex, version);
+  this->contribute(sizeof(indexed_version), &indexed_version, CkReduction::concat,
+      CkCallback(CkIndex_CacheManager<Data>::recvVersions(NULL), cache_manager));
+}
+template <typename Data>
+void TreePiece<Data>::sendTopSummary() {
+  // one concatenating reduction hands every CacheManager the roots of all
+  // TreePieces, instead of aggregating them level by level in TreeElements
+  TopSummary<Data> summary;
+  summary.key = tp_key;
+  summary.data = root_from_tp_key->data;
+  summary.n_children = (root_from_tp_key->type == Node<Data>::Internal) ? root_from_tp_key->n_children : 0;
+  summary.cm_index = cache_local->thisIndex;
+  PUP::sizer sizer;
+  sizer | summary;
+  std::vector<char> buffer (sizer.size());
+  PUP::toMem packer (buffer.data());
+  packer | summary;
+  this->contribute(buffer.size(), buffer.data(), CkReduction::concat,
+      CkCallback(CkIndex_CacheManager<Data>::recvTopSummaries(NULL), cache_manager));
+}
+template <typename Data>
+void TreePiece<Data>::requestNodes(NodeRequest* requests, int n) {
+  // a batch always comes from a single CacheManager
+  std::vector<std::pair<Node<Data>*, int>> to_send;
+  for (int i = 0; i < n; i++) {
+    Node<Data>* node = directory.find(requests[i].key);
+    if (!node) node = root_from_tp_key->findNode(requests[i].key);
+    if (!node) CkPrintf("null found for key %d on tp %d\n", requests[i].key, this->thisIndex);
+    else to_send.push_back(std::make_pair(node, requests[i].depth));
+  }
+  if (n) cache_local->serviceRequests(to_send, requests[0].cm_index);
+}
+template <typename Data>
+Vector3D<Real>* TreePiece<Data>::forcesOf(Node<Data>* node) {
+  // only nodes whose particles live in this TreePiece can receive forces
+  if (!particles.size() || node->particles < particles.data() || node->particles >= particles.data() + particles.size()) return nullptr;
+  return forces.data() + (node->particles - particles.data());
+}
+template <typename Data>
+void TreePiece<Data>::resetForces() {
+  forces.assign(particles.size(), Vector3D<Real>(0,0,0));
 }
 template <typename Data>
 void TreePiece<Data>::goDown(Key new_key) {
+  cache_local->beginWalk();
   traverser->traverse(new_key);
+  cache_local->flushRequests();
+  cache_local->endWalk();
+  checkTraversalDone();
+}
+template <typename Data>
+void TreePiece<Data>::checkTraversalDone() {
+  if (!traversal_done && traverser->isDone()) {
+    traversal_done = true;
+    this->contribute(traversal_cb);
+  }
 }
 template <typename Data>
 void TreePiece<Data>::processLocal(const CkCallback& cb) {
@@ -405,21 +1137,24 @@ void TreePiece<Data>::interact(const CkCallback& cb) {
 }
 
 template <typename Data>
-void TreePiece<Data>::perturb (Real timestep, bool if_flush) {
+void TreePiece<Data>::perturb (Real timestep, bool if_flush, const CkCallback& cb) {
 
   if (if_flush) {
     for (auto leaf : leaves) {
       for (int i = 0; i < leaf->n_particles; i++) {
-        leaf->particles[i].perturb(timestep, leaf->sum_forces[i], readers.ckLocalBranch()->universe.box);
+        leaf->particles[i].perturb(timestep, forcesOf(leaf)[i], readers.ckLocalBranch()->universe.box);
       }
     }
+    leaf_kept.resize(0);
+    leaf_moved.resize(0);
     flush(readers);
+    this->contribute(cb);
     return;
   }
 
   for (int i = 0; i < leaves.size(); i++) {
     for (int j = 0; j < leaves[i]->n_particles; j++) {
-//      CkPrintf("sum forces y %lf\n", leaves[i]->sum_forces[j].y);
+//      CkPrintf("sum forces y %lf\n", forcesOf(leaves[i])[j].y);
     }
   }
 
@@ -435,18 +1170,27 @@ void TreePiece<Data>::perturb (Real timestep, bool if_flush) {
   }
   OrientedBox<Real> tp_box = readers.ckLocalBranch()->universe.box;
   for (int i = remainders.size()-1; i >= 0; i--) {
-    for (int dim = 0; dim < 3; dim++) {
-      if (remainders[i] & (1 << (2-dim))) tp_box.lesser_corner[dim] = tp_box.center()[dim];
+    for (int dim = 0; dim < NDIM; dim++) {
+      if (remainders[i] & (1 << (NDIM-1-dim))) tp_box.lesser_corner[dim] = tp_box.center()[dim];
       else tp_box.greater_corner[dim] = tp_box.center()[dim];
     }
   }
 
+  // particles that stay are kept leaf by leaf so the next refit can tell
+  // which leaves changed
   // calculate bounding box of TP
-  for (auto leaf : leaves) {
+  leaf_kept.assign(leaves.size(), 0);
+  leaf_moved.assign(leaves.size(), false);
+  for (int l = 0; l < leaves.size(); l++) {
+    Node<Data>* leaf = leaves[l];
     for (int i = 0; i < leaf->n_particles; i++) {
       Particle& particle = leaf->particles[i];
       Vector3D<Real> old_position = particle.position;
-      particle.perturb(timestep, leaf->sum_forces[i], readers.ckLocalBranch()->universe.box);
+      Vector3D<Real>* leaf_forces = forcesOf(leaf);
+      particle.perturb(timestep, leaf_forces[i], readers.ckLocalBranch()->universe.box);
+      for (int dim = 0; dim < NDIM; dim++) {
+        if (particle.position[dim] != old_position[dim]) leaf_moved[l] = true;
+      }
       //CkPrintf("magitude of displacement = %lf\n", (old_position - leaf->particles[i].position).length());
       //CkPrintf("total centroid is (%lf, %lf, %lf)\n", root->data.getCentroid().x, root->data.getCentroid().y, root->data.getCentroid().z);
       OrientedBox<Real> curr_box = tp_box;
@@ -456,12 +1200,13 @@ void TreePiece<Data>::perturb (Real timestep, bool if_flush) {
         //CkPrintf("not under umbrella of node %d with volume %lf\n", node->key, curr_box.volume());
         if (node->parent == nullptr) CkPrintf("point (%lf, %lf, %lf) has force (%lf, %llf, %lf) and old position (%lf, %lf, %lf)\n",
                 particle.position.x, particle.position.y, particle.position.z,
-		leaf->sum_forces[i].x / .001, leaf->sum_forces[i].y / .001, leaf->sum_forces[i].z / .001,
+		leaf_forces[i].x / .001, leaf_forces[i].y / .001, leaf_forces[i].z / .001,
 		old_position.x, old_position.y, old_position.z);
-	Vector3D<Real> new_point = 2 * curr_box.greater_corner - curr_box.lesser_corner;
-        if (remainders[remainders_index] & 4) new_point.x = 2 * curr_box.lesser_corner.x - curr_box.greater_corner.x;
-        if (remainders[remainders_index] & 2) new_point.y = 2 * curr_box.lesser_corner.y - curr_box.greater_corner.y;
-        if (remainders[remainders_index] & 1) new_point.z = 2 * curr_box.lesser_corner.z - curr_box.greater_corner.z;
+	Vector3D<Real> new_point = curr_box.greater_corner;
+        for (int dim = 0; dim < NDIM; dim++) {
+          if (remainders[remainders_index] & (1 << (NDIM-1-dim))) new_point[dim] = 2 * curr_box.lesser_corner[dim] - curr_box.greater_corner[dim];
+          else new_point[dim] = 2 * curr_box.greater_corner[dim] - curr_box.lesser_corner[dim];
+        }
         curr_box.grow(new_point);
         remainders_index++;
         node = node->parent;
@@ -470,9 +1215,9 @@ void TreePiece<Data>::perturb (Real timestep, bool if_flush) {
       while (node->tp_index < 0) {
         int child = 0;
         Vector3D<Real> mean = curr_box.center();
-        for (int dim = 0; dim < 3; dim++) {
+        for (int dim = 0; dim < NDIM; dim++) {
           if (particle.position[dim] > mean[dim]) {
-            child |= (1 << (2 - dim));
+            child |= (1 << (NDIM - 1 - dim));
             curr_box.lesser_corner[dim] = mean[dim];
           }
           else curr_box.greater_corner[dim] = mean[dim];
@@ -486,18 +1231,40 @@ void TreePiece<Data>::perturb (Real timestep, bool if_flush) {
         if (!node) CkPrintf("node not legit\n");
       }
 
-      if (node == root_from_tp_key) in_particles.push_back(particle);
+      if (node == root_from_tp_key) {
+        in_particles.push_back(particle);
+        leaf_kept[l]++;
+      }
       else {
         std::vector<Particle>& particle_vec = out_particles[node->tp_index];
         particle_vec.push_back(particle);
       }
     }
   }
+  // every TreePiece learns how many particles are headed its way from the
+  // summed send counts, and is done once they have all arrived
+  perturb_cb = cb;
+  std::vector<int> send_counts (n_treepieces, 0);
   for (auto it = out_particles.begin(); it != out_particles.end(); it++) {
     ParticleMsg* msg = new (it->second.size()) ParticleMsg (it->second.data(), it->second.size());
+    send_counts[it->first] += it->second.size();
     this->thisProxy[it->first].receive(msg);
   } 
   particles = in_particles;
+  this->contribute(send_counts.size() * sizeof(int), send_counts.data(), CkReduction::sum_int,
+      CkCallback(CkIndex_TreePiece<Data>::recvMigrationCounts(NULL), this->thisProxy));
+}
+template <typename Data>
+void TreePiece<Data>::recvMigrationCounts(CkReductionMsg* msg) {
+  n_expected_migrants = ((int*)msg->getData())[this->thisIndex];
+  delete msg;
+  checkMigrationDone();
+}
+template <typename Data>
+void TreePiece<Data>::checkMigrationDone() {
+  if (n_migrated < n_expected_migrants) return;
+  n_expected_migrants = -1;
+  this->contribute(perturb_cb);
 }
 template <typename Data>
 void TreePiece<Data>::flush(CProxy_Reader readers) {
@@ -505,12 +1272,88 @@ void TreePiece<Data>::flush(CProxy_Reader readers) {
   flushed_particles.resize(0);
   flushed_particles.insert(flushed_particles.end(), particles.begin(), particles.end());
 
+  // handed over directly, so the Reader has them once this returns
   ParticleMsg *msg = new (particles.size()) ParticleMsg(particles.data(), particles.size());
-  readers[CkMyPe()].receive(msg);
+  readers.ckLocalBranch()->receive(msg);
   particles.resize(0);
   particle_index = 0;
 }
 template <typename Data>
+template <typename Visitor>
+void TreePiece<Data>::benchLocalWalk(const CkCallback& cb) {
+  // the same visitor-driven walk of the local tree for every leaf, as a
+  // traverser does it, on the pointer layout vs. the flat layout
+  Visitor v;
+  double times[2] = {0.0, 0.0};
+  long n_leaves[2] = {0, 0};
+  double start = CkWallTimer();
+  for (auto leaf : leaves) {
+    TargetNode<Data> target (leaf, nullptr);
+    std::stack<Node<Data>*> nodes;
+    if (root_from_tp_key) nodes.push(root_from_tp_key);
+    while (nodes.size()) {
+      Node<Data>* node = nodes.top();
+      nodes.pop();
+      if (node->type == Node<Data>::Leaf) n_leaves[0]++;
+      else if (node->type == Node<Data>::Internal && v.node(SourceNode<Data>(node), target)) {
+        for (int i = 0; i < node->n_children; i++) nodes.push(node->children[i].load());
+      }
+    }
+  }
+  times[0] = CkWallTimer() - start;
+
+  start = CkWallTimer();
+  FlatTree<Data> local_flat;
+  if (!flat_tree.size()) local_flat.build(root_from_tp_key);
+  const FlatTree<Data>& flat = flat_tree.size() ? flat_tree : local_flat;
+  double build_time = CkWallTimer() - start;
+  start = CkWallTimer();
+  if (flat.size()) {
+    for (auto leaf : leaves) {
+      TargetNode<Data> target (leaf, nullptr);
+      flat.walk(0,
+          [&](int j) {return v.node(SourceNode<Data>(flat, j), target);},
+          [&](int) {n_leaves[1]++;},
+          [](int) {});
+    }
+  }
+  times[1] = CkWallTimer() - start;
+
+  if (n_leaves[0] != n_leaves[1]) {
+    CkPrintf("[TP %d] flat tree walk reached %ld leaves, pointer walk %ld\n", this->thisIndex, n_leaves[1], n_leaves[0]);
+  }
+#if DEBUG
+  CkPrintf("[TP %d] flat tree build: %lf seconds\n", this->thisIndex, build_time);
+#endif
+  this->contribute(2 * sizeof(double), times, CkReduction::max_double, cb);
+}
+template <typename Data>
+void TreePiece<Data>::benchBuild(const CkCallback& cb) {
+  // rebuild the subtree under the TP key on scratch nodes, top-down with
+  // recursiveBuild and with the single-scan builder, both on one PE
+  double times[2] = {0.0, 0.0};
+  if (root_from_tp_key && tree_type == OCT_TREE) {
+    for (int pass = 0; pass < 2; pass++) {
+      Node<Data>* scratch = new Node<Data>(root_from_tp_key->key, root_from_tp_key->depth, root_from_tp_key->n_particles,
+          root_from_tp_key->particles, 0, n_treepieces - 1, nullptr, this->thisIndex);
+      std::vector<Node<Data>*> scratch_leaves, scratch_empty_leaves;
+      double start = CkWallTimer();
+      // entering below the TP key keeps recursiveBuild from handing off
+      if (pass == 0) recursiveBuild(scratch, true, scratch_leaves, scratch_empty_leaves, false);
+#if BOTTOM_UP_BUILD
+      else {
+        BottomUpBuilder<Data> builder(scratch, ceil(BUCKET_TOLERANCE * max_particles_per_leaf), this->thisIndex, n_treepieces);
+        builder.build(scratch_leaves, scratch_empty_leaves);
+      }
+#endif
+      times[pass] = CkWallTimer() - start;
+      scratch->triggerFree();
+      delete scratch;
+    }
+  }
+  this->contribute(2 * sizeof(double), times, CkReduction::sum_double, cb);
+}
+template <typename Data>
 void TreePiece<Data>::print(Node<Data>* root) {
   ostringstream oss;
   oss << "tree." << this->thisIndex << ".dot";
@@ -3,6 +3,7 @@
 
 #include "Particle.h"
 #include "Node.h"
+#include "FlatTree.h"
 
 template <typename Data>
 struct SourceNode {
@@ -13,6 +14,7 @@ struct SourceNode {
 
   SourceNode() : depth(0), n_particles(0), particles(nullptr), data(nullptr) {}
   SourceNode (Node<Data>* input) : depth(input->depth), n_particles(input->n_particles), particles(input->particles), data(const_cast<const Data*> (&(input->data))) {}
+  SourceNode (const FlatTree<Data>& tree, int i) : depth(tree.depths[i]), n_particles(tree.n_particles[i]), particles(tree.particles[i]), data(&(tree.data[i])) {}
 };
 
 template <typename Data>
@@ -21,16 +23,16 @@ struct TargetNode {
   int n_particles;
   Particle* particles;
   Data* data;
-  std::vector<Vector3D<Real>>* sum_forces;
+  Vector3D<Real>* sum_forces; // slice of the owning TreePiece's force buffer
 
   void applyForce(int which_particle, Vector3D<Real> force) {
-    if (which_particle < n_particles) {
-      (*sum_forces)[which_particle] += force;
+    if (sum_forces && which_particle < n_particles) {
+      sum_forces[which_particle] += force;
     }
   }
 
   TargetNode() : depth(0), n_particles(0), particles(nullptr), data(nullptr), sum_forces(nullptr) {}
-  TargetNode (Node<Data>* input) : depth(input->depth), n_particles(input->n_particles), particles(input->particles), data(&(input->data)), sum_forces(&(input->sum_forces)) {}
+  TargetNode (Node<Data>* input, Vector3D<Real>* sum_forcesi = nullptr) : depth(input->depth), n_particles(input->n_particles), particles(input->particles), data(&(input->data)), sum_forces(sum_forcesi) {}
 };
 
 
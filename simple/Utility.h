@@ -2,6 +2,8 @@
 #define SIMPLE_UTILITY_H_
 
 #include "common.h"
+#include "OrientedBox.h"
+#include <algorithm>
 
 class Utility {
 
@@ -11,6 +13,9 @@ class Utility {
 
     if (x == Key(0)) return -1;
     n = 0;
+#if KEY_128
+    if (x > Key(0xFFFFFFFFFFFFFFFFULL)) {n += 64; x >>= 64;}
+#endif
     if (x > Key(0x00000000FFFFFFFF)) {n += 32; x >>= 32;}
     if (x > Key(0x000000000000FFFF)) {n += 16; x >>= 16;}
     if (x > Key(0x00000000000000FF)) {n += 8; x >>= 8;}
@@ -27,6 +32,9 @@ class Utility {
     x |= (x >> 8);
     x |= (x >> 16);
     x |= (x >> 32);
+#if KEY_128
+    x |= (x >> 64);
+#endif
     return(x & ~(x >> 1));
   }
 
@@ -104,6 +112,35 @@ class Utility {
     return k1 == k2;
   }
 
+  // SFC key of a position in the universe, without the placeholder bit
+  static Key generateKey(Vector3D<Real> position, OrientedBox<Real> box) {
+#if NDIM == 3 && !KEY_128
+    return SFC::generateKey(position, box);
+#else
+    Key key = Key(0);
+    for (int dim = 0; dim < NDIM; dim++) {
+      double extent = box.greater_corner[dim] - box.lesser_corner[dim];
+      double scaled = (extent > 0) ? (position[dim] - box.lesser_corner[dim]) / extent : 0.0;
+      Key coord = Key(scaled * double(BOXES_PER_DIM));
+      if (coord >= BOXES_PER_DIM) coord = BOXES_PER_DIM - 1;
+      for (int bit = 0; bit < BITS_PER_DIM; bit++) {
+        if (coord & (Key(1) << bit)) key |= Key(1) << (bit * NDIM + (NDIM - 1 - dim));
+      }
+    }
+    // line the digits up right below the placeholder bit
+    return key << (KEY_BITS - 1 - BITS_PER_DIM * NDIM);
+#endif
+  }
+
+  // longest side of the box over the dimensions the tree splits
+  static Real maxExtent(const OrientedBox<Real>& box) {
+    Real extent = 0;
+    for (int dim = 0; dim < NDIM; dim++) {
+      extent = std::max(extent, box.greater_corner[dim] - box.lesser_corner[dim]);
+    }
+    return extent;
+  }
+
   static Key removeLeadingZeros(Key k) {
     int depth = getDepthFromKey(k);
     return getParticleLevelKey(k, depth);
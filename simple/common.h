@@ -7,7 +7,12 @@
 #include "Vector3D.h"
 #include "SFC.h"
 
-/* Floating point type */
+/* Floating point type: a float mantissa holds 24 bits per dimension, more
+ * than the 21 levels of 64-bit keys but far fewer than the 42 of 128-bit
+ * keys, so KEY_128 always uses double (53 bits) */
+#if KEY_128 && !defined(USE_DOUBLE_FP)
+#define USE_DOUBLE_FP
+#endif
 #ifndef USE_DOUBLE_FP
 typedef float Real;
 #define REAL_MAX FLT_MAX
@@ -21,29 +26,84 @@ typedef double Real;
 #define SFC_DECOMP 11
 
 #define MAX_PARTICLES_PER_TP 1000
-#define MAX_PARTICLES_PER_LEAF 10
+#define MAX_PARTICLES_PER_LEAF 10 // default, set at runtime with -l
 
-#define LOCAL_CACHE_SIZE 5000
+#define LOOKUP_ENTRIES_PER_PE 4096 // default, set at runtime with -k
 
 /* Tree types */
 #define OCT_TREE 20
 
-#define BRANCH_FACTOR 8
-#define LOG_BRANCH_FACTOR 3
-
+/* Dimensionality of the tree: 3 builds an octree, 2 a quadtree (z = 0) */
+#ifndef NDIM
 #define NDIM 3
+#endif
+
+#define BRANCH_FACTOR (1 << NDIM)
+#define LOG_BRANCH_FACTOR NDIM
 
+/* Key type: 64-bit SFC keys (21 levels in 3D) by default,
+ * 128-bit keys (42 levels in 3D) with KEY_128 for deep, clustered trees.
+ * Levels below the precision of Real only encode rounding noise, which is
+ * why KEY_128 forces double precision */
+#if KEY_128
+#include "pup.h"
+#include <functional>
+typedef unsigned __int128 Key;
+PUPbytes(Key)
+#if defined(__STRICT_ANSI__)
+// libstdc++ only hashes 128-bit integers in GNU mode
+namespace std {
+template <> struct hash<Key> {
+  size_t operator()(Key k) const {
+    return hash<uint64_t>()(uint64_t(k) ^ (uint64_t(k >> 64) * 0x9E3779B97F4A7C15ULL));
+  }
+};
+}
+#endif
+#else
 typedef SFC::Key Key;
+#endif
 #ifndef CHAR_BIT
 #define CHAR_BIT 8
 #endif
 #define KEY_BITS (sizeof(Key)*CHAR_BIT)
-#define BITS_PER_DIM (KEY_BITS/NDIM)
-#define BOXES_PER_DIM (1<<(BITS_PER_DIM))
+#define BITS_PER_DIM ((KEY_BITS-1)/NDIM) // one bit is the placeholder
+#define BOXES_PER_DIM (Key(1)<<(BITS_PER_DIM))
+
+/* Leaf criteria */
+#define COUNT_LEAF 30
+#define COST_LEAF 31
+#define EXTENT_LEAF 32
+#define DEPTH_LEAF 33
 
 #define DECOMP_TOLERANCE 1.0
 #define BUCKET_TOLERANCE 1.0
 
 #define UP_ONLY 7
 
+/* Minimum number of particles under a node for TreePiece::build to split
+ * its work across the PEs of the SMP node (with PARALLEL_BUILD) */
+#define PARALLEL_BUILD_THRESHOLD 100000
+
+/* Depth of the global occupancy counts used to avoid fetching empty
+ * remote subtrees; 4096 bins whatever the dimension */
+#define OCCUPANCY_LEVELS (12/LOG_BRANCH_FACTOR)
+
+/* Reductions every build sends each CacheManager, which has to hold all
+ * of them before prefetching: occupancy, versions and the top summaries */
+#if COLLECTIVE_TOP
+#define BUILD_INPUTS 3
+#else
+#define BUILD_INPUTS 2
+#endif
+
+/* Levels shipped below a requested remote node: a CacheManager starts at
+ * the default and adapts between the bounds, separately for each depth of
+ * the requested node, by how often it has to ask again for the bottom of
+ * a previous fetch. Replies stop growing once they reach the byte budget */
+#define DEFAULT_FETCH_DEPTH 2
+#define MAX_FETCH_DEPTH 6
+#define FETCH_LEVELS (BITS_PER_DIM + 1)
+#define FETCH_BUDGET_BYTES (64*1024)
+
 #endif // SIMPLE_COMMON_H_